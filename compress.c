@@ -0,0 +1,363 @@
+/* Name: compress.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Chunked multi-threaded LZ4 and Zstandard compression of received data.
+See compress.h for the interface.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "trace.h"
+
+#define CHUNK_FREE      0   /* may be filled by the writer */
+#define CHUNK_QUEUED    1   /* full, waiting for a worker */
+#define CHUNK_BUSY      2   /* being compressed */
+#define CHUNK_DONE      3   /* compressed, waiting to be written */
+
+struct compressChunk {
+    unsigned char   *in;
+    size_t          inLen;
+    unsigned char   *out;
+    size_t          outLen;
+    int             state;
+    int             error;  /* errno value of a failed compression */
+    long            seq;    /* number of the chunk in the output, for tracing */
+};
+
+static struct compressChunk *chunks = NULL;
+static int              numChunks;
+static int              fillIndex;      /* chunk being filled */
+static int              writeIndex;     /* next chunk to write */
+static long             queuedChunks;   /* chunks queued so far */
+static size_t           outCapacity;
+static int              outFd;
+static int              method;
+static int              level;
+static int              failed;
+static int              failedErrno;
+static int              stopping;
+static usbStats         *stats;
+static pthread_t        *workers;
+static int              numWorkers;
+static pthread_mutex_t  compressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   chunkQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   chunkDone = PTHREAD_COND_INITIALIZER;
+
+/* ------------------------------------------------------------------------- */
+
+int compressParse(char *spec, int *methodPtr, int *levelPtr)
+{
+    char *colon = strchr(spec, ':'), *end;
+    size_t len = colon != NULL ? colon - spec : strlen(spec);
+
+    *levelPtr = 0;
+    if(colon != NULL){
+        *levelPtr = strtol(colon + 1, &end, 0);
+        if(end == colon + 1 || *end != 0)
+            return -1;
+    }
+    if(len == 3 && strncasecmp(spec, "lz4", len) == 0){
+#ifdef HAVE_LZ4
+        *methodPtr = COMPRESS_LZ4;
+        return 0;
+#endif
+    }else if(len == 4 && strncasecmp(spec, "zstd", len) == 0){
+#ifdef HAVE_ZSTD
+        *methodPtr = COMPRESS_ZSTD;
+        return 0;
+#endif
+    }
+    return -1;
+}
+
+static size_t   frameBound(size_t size)
+{
+    switch(method){
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        LZ4F_preferences_t prefs;
+
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        return LZ4F_compressFrameBound(size, &prefs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+    }
+    return size;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void *compressWorker(void *arg)
+{
+    struct compressChunk *c;
+    int i;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx = method == COMPRESS_ZSTD ? ZSTD_createCCtx() : NULL;
+#endif
+
+    traceThreadInit("compressor");
+    pthread_mutex_lock(&compressLock);
+    for(;;){
+        /* take the oldest queued chunk */
+        for(c = NULL, i = 0; i < numChunks; i++){
+            struct compressChunk *q = &chunks[(writeIndex + i) % numChunks];
+            if(q->state == CHUNK_QUEUED){
+                c = q;
+                break;
+            }
+        }
+        if(c == NULL){
+            if(stopping)
+                break;
+            pthread_cond_wait(&chunkQueued, &compressLock);
+            continue;
+        }
+        c->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&compressLock);
+        traceEvent(TRACE_COMPRESS_BEGIN, c->seq);
+        c->error = 0;
+        switch(method){
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4: {
+            LZ4F_preferences_t prefs;
+            size_t r;
+
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = level;
+            prefs.frameInfo.contentSize = c->inLen;
+            r = LZ4F_compressFrame(c->out, outCapacity, c->in, c->inLen, &prefs);
+            if(LZ4F_isError(r))
+                c->error = EIO;
+            else
+                c->outLen = r;
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            size_t r = cctx == NULL ? 0
+                       : ZSTD_compressCCtx(cctx, c->out, outCapacity, c->in, c->inLen, level);
+
+            if(cctx == NULL)
+                c->error = ENOMEM;
+            else if(ZSTD_isError(r))
+                c->error = EIO;
+            else
+                c->outLen = r;
+            break;
+        }
+#endif
+        }
+        traceEvent(TRACE_COMPRESS_END, c->seq);
+        pthread_mutex_lock(&compressLock);
+        c->state = CHUNK_DONE;
+        pthread_cond_broadcast(&chunkDone);
+    }
+    pthread_mutex_unlock(&compressLock);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+    return NULL;
+}
+
+static void writeOut(struct compressChunk *c)
+{
+    unsigned char *p = c->out;
+    size_t left = c->outLen;
+    ssize_t r;
+
+    if(c->error != 0 && !failed){
+        failed = 1;
+        failedErrno = c->error;
+    }
+    while(!failed && left > 0){
+        if((r = write(outFd, p, left)) < 0){
+            if(errno == EINTR)
+                continue;
+            failed = 1;
+            failedErrno = errno;
+            break;
+        }
+        p += r;
+        left -= r;
+    }
+    STATS_ADD(stats->compressOut, c->outLen);
+}
+
+/* Writes compressed chunks in order. If 'wait' is set, waits for the oldest
+ * chunk to be compressed. Called with the lock held.
+ */
+static void writeDone(int wait)
+{
+    struct compressChunk *c;
+    long long start;
+
+    for(;;){
+        c = &chunks[writeIndex];
+        if(c->state == CHUNK_DONE){
+            pthread_mutex_unlock(&compressLock);
+            writeOut(c);
+            pthread_mutex_lock(&compressLock);
+            c->state = CHUNK_FREE;
+            c->inLen = 0;
+            writeIndex = (writeIndex + 1) % numChunks;
+            wait = 0;
+        }else if(wait && (c->state == CHUNK_QUEUED || c->state == CHUNK_BUSY)){
+            start = statsClockNs();
+            pthread_cond_wait(&chunkDone, &compressLock);
+            STATS_ADD(stats->compressWaitNs, statsClockNs() - start);
+        }else{
+            break;
+        }
+    }
+}
+
+static void queueChunk(void)
+{
+    pthread_mutex_lock(&compressLock);
+    chunks[fillIndex].state = CHUNK_QUEUED;
+    chunks[fillIndex].seq = queuedChunks++;
+    pthread_cond_signal(&chunkQueued);
+    fillIndex = (fillIndex + 1) % numChunks;
+    while(chunks[fillIndex].state != CHUNK_FREE)
+        writeDone(1);
+    pthread_mutex_unlock(&compressLock);
+}
+
+/* ------------------------------------------------------------------------- */
+
+int compressStart(int fd, int compressMethod, int compressLevel, int threads, usbStats *counters)
+{
+    int i, err, started = 0;
+
+    method = compressMethod;
+    level = compressLevel;
+    outFd = fd;
+    stats = counters;
+    failed = 0;
+    stopping = 0;
+    numWorkers = threads > 0 ? threads : 1;
+    numChunks = 2 * numWorkers + 1;
+    fillIndex = writeIndex = 0;
+    queuedChunks = 0;
+    outCapacity = frameBound(COMPRESS_CHUNK);
+    workers = NULL;
+    if((chunks = calloc(numChunks, sizeof(chunks[0]))) == NULL
+       || (workers = calloc(numWorkers, sizeof(workers[0]))) == NULL)
+        goto error;
+    for(i = 0; i < numChunks; i++){
+        if((chunks[i].in = malloc(COMPRESS_CHUNK)) == NULL
+           || (chunks[i].out = malloc(outCapacity)) == NULL)
+            goto error;
+    }
+    for(started = 0; started < numWorkers; started++){
+        if((err = pthread_create(&workers[started], NULL, compressWorker, NULL)) != 0){
+            errno = err;
+            goto error;
+        }
+    }
+    return 0;
+
+error:
+    err = errno;
+    /* the workers started so far free their compression contexts on exit */
+    pthread_mutex_lock(&compressLock);
+    stopping = 1;
+    pthread_cond_broadcast(&chunkQueued);
+    pthread_mutex_unlock(&compressLock);
+    for(i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    if(chunks != NULL){
+        for(i = 0; i < numChunks; i++){
+            free(chunks[i].in);
+            free(chunks[i].out);
+        }
+    }
+    free(chunks);
+    free(workers);
+    chunks = NULL;
+    workers = NULL;
+    errno = err;
+    return -1;
+}
+
+int compressWrite(void *context, long seq, unsigned char *data, int len)
+{
+    struct compressChunk *c;
+    size_t n;
+
+    STATS_ADD(stats->compressIn, len);
+    while(len > 0){
+        c = &chunks[fillIndex];
+        n = COMPRESS_CHUNK - c->inLen;
+        if(n > len)
+            n = len;
+        memcpy(c->in + c->inLen, data, n);
+        c->inLen += n;
+        data += n;
+        len -= n;
+        if(c->inLen == COMPRESS_CHUNK)
+            queueChunk();
+    }
+    pthread_mutex_lock(&compressLock);
+    writeDone(0);
+    pthread_mutex_unlock(&compressLock);
+    return failed ? -1 : 0;
+}
+
+int compressStop(void)
+{
+    int i;
+
+    if(chunks == NULL)
+        return 0;
+    if(chunks[fillIndex].inLen > 0 && numWorkers > 0)
+        queueChunk();
+    pthread_mutex_lock(&compressLock);
+    while(chunks[writeIndex].state != CHUNK_FREE && numWorkers > 0)
+        writeDone(1);
+    stopping = 1;
+    pthread_cond_broadcast(&chunkQueued);
+    pthread_mutex_unlock(&compressLock);
+    for(i = 0; i < numWorkers; i++)
+        pthread_join(workers[i], NULL);
+    for(i = 0; i < numChunks; i++){
+        free(chunks[i].in);
+        free(chunks[i].out);
+    }
+    free(chunks);
+    free(workers);
+    chunks = NULL;
+    if(failed){
+        errno = failedErrno;
+        return -1;
+    }
+    return 0;
+}
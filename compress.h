@@ -0,0 +1,60 @@
+/* Name: compress.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module compresses received data on worker threads before it is written
+out. The data is collected into chunks and each chunk is compressed by one
+of the workers into a separate LZ4 or Zstandard frame. The frames are
+written in order, so the output is a standard concatenation of frames which
+"lz4 -d" and "zstd -d" decompress as a whole. LZ4 support is compiled in
+with HAVE_LZ4, Zstandard support with HAVE_ZSTD (see Makefile).
+*/
+
+#ifndef __COMPRESS_H_INCLUDED__
+#define __COMPRESS_H_INCLUDED__
+
+#include "stats.h"
+
+#define COMPRESS_NONE       0
+#define COMPRESS_LZ4        1
+#define COMPRESS_ZSTD       2
+
+#define COMPRESS_CHUNK      (1 << 20)   /* bytes of input per frame */
+
+int compressParse(char *spec, int *method, int *level);
+/* Parses a compression specification of the form "lz4" or "zstd" with an
+ * optional ":<level>" suffix and stores the results in '*method' and
+ * '*level'. The level defaults to 0 (the library default).
+ * Returns: 0 on success, -1 if the specification is invalid or the method
+ * is not compiled in.
+ */
+
+int compressStart(int fd, int method, int level, int threads, usbStats *stats);
+/* This function starts 'threads' worker threads compressing the data passed
+ * to compressWrite() and prepares writing of the frames to the file
+ * descriptor 'fd'. The 'compressIn', 'compressOut' and 'compressWaitNs'
+ * counters of 'stats' are updated as data is written.
+ * Returns: 0 on success or -1 on error (errno is set).
+ */
+
+int compressWrite(void *context, long seq, unsigned char *data, int len);
+/* Queues 'len' bytes of data for compression and writes out the frames
+ * compressed so far. Waits for a worker if all chunks are busy. The
+ * signature is that of usbSinkWriter, 'context' and 'seq' are not used.
+ * Must be called from a single thread.
+ * Returns: 0 on success or -1 if writing has failed.
+ */
+
+int compressStop(void);
+/* Compresses and writes the remaining data and stops the workers.
+ * Returns: 0 on success or -1 on error (errno is set).
+ */
+
+#endif /* __COMPRESS_H_INCLUDED__ */
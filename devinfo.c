@@ -0,0 +1,858 @@
+/* Name: devinfo.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Descriptor tree collection and rendering for the info command.
+See devinfo.h for the interface.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "devinfo.h"
+
+extern libusb_context* usbCtx;
+
+#define ARENA_BLOCK     65536
+#define STRING_TIMEOUT  1000    /* ms */
+
+struct arenaBlock {
+    struct arenaBlock   *next;
+    size_t              used;
+    size_t              size;
+    unsigned char       data[];
+};
+
+struct usbInfo {
+    struct arenaBlock   *blocks;
+    usbDeviceInfo       *first;
+    usbDeviceInfo       *last;
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* returns zeroed memory which lives until usbInfoFree() */
+static void *arenaAlloc(usbInfo *info, size_t size)
+{
+    struct arenaBlock *b = info->blocks;
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if(b == NULL || b->used + size > b->size){
+        size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+
+        if((b = malloc(sizeof(*b) + blockSize)) == NULL)
+            return NULL;
+        b->next = info->blocks;
+        b->used = 0;
+        b->size = blockSize;
+        info->blocks = b;
+    }
+    p = b->data + b->used;
+    b->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static char *arenaString(usbInfo *info, const char *s)
+{
+    char *p = arenaAlloc(info, strlen(s) + 1);
+
+    if(p != NULL)
+        strcpy(p, s);
+    return p;
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct stringRequest {
+    struct libusb_transfer  *transfer;
+    int                     index;
+    int                     done;
+    int                     *pending;
+    unsigned char           buffer[LIBUSB_CONTROL_SETUP_SIZE + 255];
+};
+
+static void LIBUSB_CALL stringDone(struct libusb_transfer *transfer)
+{
+    struct stringRequest *request = transfer->user_data;
+
+    request->done = 1;
+    (*request->pending)--;
+}
+
+static int  transferError(int status)
+{
+    switch(status){
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+    return LIBUSB_ERROR_IO;
+}
+
+/* Requests the string descriptors flagged in 'wanted' all at once and stores
+ * them converted to ASCII (like libusb_get_string_descriptor_ascii()) in
+ * 'strings'.
+ */
+static void fetchStrings(usbInfo *info, libusb_device_handle *handle, const unsigned char *wanted,
+                         char **strings, FILE *warningsFp)
+{
+    struct stringRequest *requests;
+    unsigned char langBuffer[4];
+    char text[128];
+    int i, j, r, n = 0, tries, langid;
+    int *pending;   /* on the heap: see below */
+
+    for(i = 1; i < 256; i++)
+        n += wanted[i];
+    if(n == 0)
+        return;
+    /* the language is needed before anything else */
+    if((r = libusb_get_string_descriptor(handle, 0, 0, langBuffer, sizeof(langBuffer))) < 4){
+        if(warningsFp)
+            fprintf(warningsFp, "WARNING: Cannot query string: %s\n",
+                    libusb_error_name(r < 0 ? r : LIBUSB_ERROR_IO));
+        return;
+    }
+    langid = langBuffer[2] | langBuffer[3] << 8;
+    requests = calloc(n, sizeof(*requests));
+    pending = calloc(1, sizeof(*pending));
+    if(requests == NULL || pending == NULL){
+        free(requests);
+        free(pending);
+        return;
+    }
+    for(i = 1, n = 0; i < 256; i++){
+        struct stringRequest *request = &requests[n];
+
+        if(!wanted[i] || (request->transfer = libusb_alloc_transfer(0)) == NULL)
+            continue;
+        request->index = i;
+        request->pending = pending;
+        libusb_fill_control_setup(request->buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+                                  LIBUSB_DT_STRING << 8 | i, langid, 255);
+        libusb_fill_control_transfer(request->transfer, handle, request->buffer, stringDone,
+                                     request, STRING_TIMEOUT);
+        if((r = libusb_submit_transfer(request->transfer)) < 0){
+            if(warningsFp)
+                fprintf(warningsFp, "WARNING: Cannot query string: %s\n", libusb_error_name(r));
+            libusb_free_transfer(request->transfer);
+            request->transfer = NULL;
+            continue;
+        }
+        (*pending)++;
+        n++;
+    }
+    while(*pending > 0){
+        struct timeval tv = { 0, 100000 };
+
+        if((r = libusb_handle_events_timeout_completed(usbCtx, &tv, NULL)) < 0
+           && r != LIBUSB_ERROR_INTERRUPTED)
+            break;
+    }
+    if(*pending > 0){
+        /* event handling failed: cancel the requests and wait for them */
+        for(i = 0; i < n; i++){
+            if(!requests[i].done)
+                libusb_cancel_transfer(requests[i].transfer);
+        }
+        for(tries = 0; *pending > 0 && tries < 10; tries++){
+            struct timeval tv = { 0, 100000 };
+
+            libusb_handle_events_timeout_completed(usbCtx, &tv, NULL);
+        }
+        if(*pending > 0){
+            /* Still not reaped: the requests and the counter are left
+             * allocated, so a late callback only writes to them.
+             */
+            if(warningsFp)
+                fprintf(warningsFp, "WARNING: Cannot query strings: event handling failed\n");
+            return;
+        }
+    }
+    for(i = 0; i < n; i++){
+        struct libusb_transfer *transfer = requests[i].transfer;
+        unsigned char *data = libusb_control_transfer_get_data(transfer);
+        int len = transfer->actual_length;
+
+        if(transfer->status != LIBUSB_TRANSFER_COMPLETED || len < 2 || data[1] != LIBUSB_DT_STRING){
+            if(warningsFp)
+                fprintf(warningsFp, "WARNING: Cannot query string: %s\n",
+                        libusb_error_name(transfer->status != LIBUSB_TRANSFER_COMPLETED
+                                          ? transferError(transfer->status) : LIBUSB_ERROR_IO));
+        }else{
+            if(data[0] < len)
+                len = data[0];
+            for(j = 0; 2 + 2 * j + 1 < len && j < sizeof(text) - 1; j++)
+                text[j] = data[2 + 2 * j + 1] == 0 && data[2 + 2 * j] < 0x80 ? data[2 + 2 * j] : '?';
+            text[j] = 0;
+            strings[requests[i].index] = arenaString(info, text);
+        }
+        libusb_free_transfer(transfer);
+    }
+    free(requests);
+    free(pending);
+}
+
+/* ------------------------------------------------------------------------- */
+
+usbInfo *usbInfoNew(void)
+{
+    return calloc(1, sizeof(usbInfo));
+}
+
+void usbInfoFree(usbInfo *info)
+{
+    struct arenaBlock *b, *next;
+
+    if(info == NULL)
+        return;
+    for(b = info->blocks; b != NULL; b = next){
+        next = b->next;
+        free(b);
+    }
+    free(info);
+}
+
+static int  addConfig(usbInfo *info, usbConfigInfo *c, const struct libusb_config_descriptor *config,
+                      unsigned char *wanted)
+{
+    int i, j, k;
+
+    c->value = config->bConfigurationValue;
+    c->attributes = config->bmAttributes;
+    c->maxPower = config->MaxPower;
+    c->descriptionIndex = config->iConfiguration;
+    wanted[config->iConfiguration] = 1;
+    c->numInterfaces = config->bNumInterfaces;
+    if((c->interfaces = arenaAlloc(info, c->numInterfaces * sizeof(*c->interfaces))) == NULL)
+        return -1;
+    for(i = 0; i < c->numInterfaces; i++){
+        const struct libusb_interface *inter = &config->interface[i];
+        usbInterfaceInfo *in = &c->interfaces[i];
+
+        in->numAltsettings = inter->num_altsetting;
+        if((in->altsettings = arenaAlloc(info, in->numAltsettings * sizeof(*in->altsettings))) == NULL)
+            return -1;
+        for(j = 0; j < in->numAltsettings; j++){
+            const struct libusb_interface_descriptor *interdesc = &inter->altsetting[j];
+            usbAltsettingInfo *a = &in->altsettings[j];
+
+            a->number = interdesc->bInterfaceNumber;
+            a->alternate = interdesc->bAlternateSetting;
+            a->interfaceClass = interdesc->bInterfaceClass;
+            a->subclass = interdesc->bInterfaceSubClass;
+            a->protocol = interdesc->bInterfaceProtocol;
+            a->descriptionIndex = interdesc->iInterface;
+            wanted[interdesc->iInterface] = 1;
+            a->numEndpoints = interdesc->bNumEndpoints;
+            if((a->endpoints = arenaAlloc(info, a->numEndpoints * sizeof(*a->endpoints))) == NULL)
+                return -1;
+            for(k = 0; k < a->numEndpoints; k++){
+                const struct libusb_endpoint_descriptor *epdesc = &interdesc->endpoint[k];
+                struct libusb_ss_endpoint_companion_descriptor *companion;
+                usbEndpointInfo *e = &a->endpoints[k];
+
+                e->address = epdesc->bEndpointAddress;
+                e->attributes = epdesc->bmAttributes;
+                e->maxPacketSize = epdesc->wMaxPacketSize;
+                e->interval = epdesc->bInterval;
+                if(epdesc->extra_length > 0
+                   && libusb_get_ss_endpoint_companion_descriptor(usbCtx, epdesc, &companion) == 0){
+                    e->hasCompanion = 1;
+                    e->maxBurst = companion->bMaxBurst;
+                    e->companionAttributes = companion->bmAttributes;
+                    e->bytesPerInterval = companion->wBytesPerInterval;
+                    libusb_free_ss_endpoint_companion_descriptor(companion);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int  addCapabilities(usbInfo *info, usbDeviceInfo *d, libusb_device_handle *handle)
+{
+    struct libusb_bos_descriptor *bos;
+    int i;
+
+    if(libusb_get_bos_descriptor(handle, &bos) != 0)
+        return 0;   /* not having one is fine */
+    d->numCapabilities = bos->bNumDeviceCaps;
+    if((d->capabilities = arenaAlloc(info, d->numCapabilities * sizeof(*d->capabilities))) == NULL){
+        libusb_free_bos_descriptor(bos);
+        return -1;
+    }
+    for(i = 0; i < d->numCapabilities; i++){
+        struct libusb_bos_dev_capability_descriptor *cap = bos->dev_capability[i];
+        usbCapabilityInfo *c = &d->capabilities[i];
+
+        c->type = cap->bDevCapabilityType;
+        c->length = cap->bLength > 3 ? cap->bLength - 3 : 0;
+        if((c->data = arenaAlloc(info, c->length)) == NULL){
+            libusb_free_bos_descriptor(bos);
+            return -1;
+        }
+        memcpy(c->data, cap->dev_capability_data, c->length);
+    }
+    libusb_free_bos_descriptor(bos);
+    return 0;
+}
+
+usbDeviceInfo *usbInfoAdd(usbInfo *info, libusb_device *dev, libusb_device_handle *handle,
+                          const char *manufacturer, const char *product, const char *serial,
+                          FILE *warningsFp)
+{
+    usbDeviceInfo *d = arenaAlloc(info, sizeof(*d));
+    struct libusb_device_descriptor *desc;
+    unsigned char wanted[256];
+    char *strings[256];
+    int c, i, j, n;
+
+    if(d == NULL)
+        return NULL;
+    desc = &d->descriptor;
+    if(libusb_get_device_descriptor(dev, desc) < 0){
+        if(warningsFp)
+            fprintf(warningsFp, "Warning: Failed to get device descriptor.\n");
+        return NULL;
+    }
+    memset(wanted, 0, sizeof(wanted));
+    memset(strings, 0, sizeof(strings));
+    d->bus = libusb_get_bus_number(dev);
+    d->address = libusb_get_device_address(dev);
+    d->speed = libusb_get_device_speed(dev);
+    n = libusb_get_port_numbers(dev, d->ports, sizeof(d->ports));
+    d->numPorts = n > 0 ? n : 0;
+    if(manufacturer == NULL)
+        wanted[desc->iManufacturer] = 1;
+    if(product == NULL)
+        wanted[desc->iProduct] = 1;
+    if(serial == NULL)
+        wanted[desc->iSerialNumber] = 1;
+
+    d->numConfigs = desc->bNumConfigurations;
+    if((d->configs = arenaAlloc(info, d->numConfigs * sizeof(*d->configs))) == NULL)
+        return NULL;
+    for(c = 0; c < d->numConfigs; c++){
+        struct libusb_config_descriptor *config;
+        int r;
+
+        if((r = libusb_get_config_descriptor(dev, c, &config)) < 0){
+            if(warningsFp)
+                fprintf(warningsFp, "Warning: Failed to get configuration descriptor %d: %s\n",
+                        c, libusb_error_name(r));
+            continue;
+        }
+        r = addConfig(info, &d->configs[c], config, wanted);
+        libusb_free_config_descriptor(config);
+        if(r < 0)
+            return NULL;
+    }
+    if(handle != NULL){
+        if(desc->bcdUSB >= 0x0201 && addCapabilities(info, d, handle) < 0)
+            return NULL;
+        wanted[0] = 0;
+        fetchStrings(info, handle, wanted, strings, warningsFp);
+    }
+
+    d->manufacturer = arenaString(info, manufacturer != NULL ? manufacturer
+                                        : strings[desc->iManufacturer] ? strings[desc->iManufacturer] : "");
+    d->product = arenaString(info, product != NULL ? product
+                                   : strings[desc->iProduct] ? strings[desc->iProduct] : "");
+    d->serial = arenaString(info, serial != NULL ? serial
+                                  : strings[desc->iSerialNumber] ? strings[desc->iSerialNumber] : "");
+    if(d->manufacturer == NULL || d->product == NULL || d->serial == NULL)
+        return NULL;
+    for(c = 0; c < d->numConfigs; c++){
+        usbConfigInfo *config = &d->configs[c];
+
+        if(config->descriptionIndex > 0)
+            config->description = strings[config->descriptionIndex];
+        for(i = 0; config->interfaces != NULL && i < config->numInterfaces; i++){
+            for(j = 0; j < config->interfaces[i].numAltsettings; j++){
+                usbAltsettingInfo *a = &config->interfaces[i].altsettings[j];
+
+                if(a->descriptionIndex > 0)
+                    a->description = strings[a->descriptionIndex];
+            }
+        }
+    }
+
+    if(info->last != NULL)
+        info->last->next = d;
+    else
+        info->first = d;
+    info->last = d;
+    return d;
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct outBuffer {
+    char        *data;
+    size_t      len;
+    size_t      size;
+    int         failed;
+};
+
+static int  bufReserve(struct outBuffer *b, size_t n)
+{
+    char *p;
+    size_t size;
+
+    if(b->failed)
+        return -1;
+    if(b->len + n <= b->size)
+        return 0;
+    for(size = b->size > 0 ? b->size : 65536; size < b->len + n; size *= 2)
+        continue;
+    if((p = realloc(b->data, size)) == NULL){
+        b->failed = 1;
+        return -1;
+    }
+    b->data = p;
+    b->size = size;
+    return 0;
+}
+
+static void bufAppend(struct outBuffer *b, const void *data, size_t n)
+{
+    if(n > 0 && bufReserve(b, n) == 0){
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+    }
+}
+
+static void bufPrintf(struct outBuffer *b, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(b->data + b->len, b->size - b->len, format, args);
+    va_end(args);
+    if(n < 0 || b->len + n < b->size){
+        if(n > 0)
+            b->len += n;
+        return;
+    }
+    if(bufReserve(b, n + 1) == 0){
+        va_start(args, format);
+        vsnprintf(b->data + b->len, b->size - b->len, format, args);
+        va_end(args);
+        b->len += n;
+    }
+}
+
+static void bufByte(struct outBuffer *b, int v)
+{
+    unsigned char c = v;
+
+    bufAppend(b, &c, 1);
+}
+
+static void bufWord(struct outBuffer *b, int v)
+{
+    bufByte(b, v & 0xff);
+    bufByte(b, (v >> 8) & 0xff);
+}
+
+static void bufString(struct outBuffer *b, const char *s)
+{
+    size_t n = s != NULL ? strlen(s) : 0;
+
+    if(n > 255)
+        n = 255;
+    bufByte(b, n);
+    bufAppend(b, s, n);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const char   *className(int classNum)
+{
+    switch(classNum){
+    case LIBUSB_CLASS_PER_INTERFACE:        return "per interface";
+    case LIBUSB_CLASS_AUDIO:                return "audio";
+    case LIBUSB_CLASS_COMM:                 return "communications";
+    case LIBUSB_CLASS_HID:                  return "HID";
+    case LIBUSB_CLASS_PHYSICAL:             return "physical";
+    case LIBUSB_CLASS_IMAGE:                return "image";
+    case LIBUSB_CLASS_PRINTER:              return "printer";
+    case LIBUSB_CLASS_MASS_STORAGE:         return "mass storage";
+    case LIBUSB_CLASS_HUB:                  return "hub";
+    case LIBUSB_CLASS_DATA:                 return "data";
+    case LIBUSB_CLASS_SMART_CARD:           return "smart card";
+    case LIBUSB_CLASS_CONTENT_SECURITY:     return "content security";
+    case LIBUSB_CLASS_VIDEO:                return "video";
+    case LIBUSB_CLASS_PERSONAL_HEALTHCARE:  return "personal healthcare";
+    case LIBUSB_CLASS_DIAGNOSTIC_DEVICE:    return "diagnostic device";
+    case LIBUSB_CLASS_WIRELESS:             return "wireless";
+    case LIBUSB_CLASS_MISCELLANEOUS:        return "misc";
+    case LIBUSB_CLASS_APPLICATION:          return "app";
+    case LIBUSB_CLASS_VENDOR_SPEC:          return "vendor-specific";
+    }
+    return "UNKNOWN!";
+}
+
+static const char   *transferTypeName(int attributes)
+{
+    static const char *names[] = { "control", "isochronous", "bulk", "interrupt" };
+
+    return names[attributes & LIBUSB_TRANSFER_TYPE_MASK];
+}
+
+static const char   *syncTypeName(int attributes)
+{
+    static const char *names[] = { "nosync", "async", "adaptive", "sync" };
+
+    return names[(attributes & LIBUSB_ISO_SYNC_TYPE_MASK) >> 2];
+}
+
+static const char   *usageTypeName(int attributes)
+{
+    static const char *names[] = { "data", "feedback", "implicit", "UNKNOWN!" };
+
+    return names[(attributes & LIBUSB_ISO_USAGE_TYPE_MASK) >> 4];
+}
+
+static const char   *speedName(int speed)
+{
+    static const char *names[] = { "unknown", "low", "full", "high", "super", "super+" };
+
+    return speed >= 0 && speed < sizeof(names) / sizeof(names[0]) ? names[speed] : "unknown";
+}
+
+static const char   *capabilityName(int type)
+{
+    switch(type){
+    case 0x01:  return "wireless USB";
+    case 0x02:  return "USB 2.0 extension";
+    case 0x03:  return "SuperSpeed USB";
+    case 0x04:  return "container ID";
+    case 0x05:  return "platform";
+    case 0x0a:  return "SuperSpeedPlus USB";
+    }
+    return "unknown";
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void renderText(struct outBuffer *b, usbDeviceInfo *d)
+{
+    struct libusb_device_descriptor *desc = &d->descriptor;
+    int c, i, j, k;
+
+    if(d->serial[0] == 0){
+        bufPrintf(b, "VID=0x%04x PID=0x%04x vendor=\"%s\" product=\"%s\"\n",
+                  desc->idVendor, desc->idProduct, d->manufacturer, d->product);
+    }else{
+        bufPrintf(b, "VID=0x%04x PID=0x%04x vendor=\"%s\" product=\"%s\" serial=\"%s\"\n",
+                  desc->idVendor, desc->idProduct, d->manufacturer, d->product, d->serial);
+    }
+    bufPrintf(b, "  Device class: %02Xh %s\n", desc->bDeviceClass, className(desc->bDeviceClass));
+    bufPrintf(b, "  Subclass: %02Xh\n", desc->bDeviceSubClass);
+    bufPrintf(b, "  Protocol: %02Xh\n", desc->bDeviceProtocol);
+    bufPrintf(b, "  Configurations (%i):\n", d->numConfigs);
+    for(c = 0; c < d->numConfigs; c++){
+        usbConfigInfo *config = &d->configs[c];
+
+        if(config->interfaces == NULL)
+            continue;
+        bufPrintf(b, "    [%i] Configuration: %i %02Xh\n", c, config->value, config->value);
+        if(config->description != NULL && config->description[0] != 0)
+            bufPrintf(b, "      Description: %s\n", config->description);
+        bufPrintf(b, "      Interfaces (%i):\n", config->numInterfaces);
+        for(i = 0; i < config->numInterfaces; i++){
+            usbInterfaceInfo *inter = &config->interfaces[i];
+
+            bufPrintf(b, "        [%i] Alternate settings (%i):\n", i, inter->numAltsettings);
+            for(j = 0; j < inter->numAltsettings; j++){
+                usbAltsettingInfo *a = &inter->altsettings[j];
+
+                bufPrintf(b, "          [%i] Setting: %i %02Xh\n", j, a->alternate, a->alternate);
+                bufPrintf(b, "            Interface number: %i %02Xh\n", a->number, a->number);
+                bufPrintf(b, "            Interface class: %02Xh %s\n",
+                          a->interfaceClass, className(a->interfaceClass));
+                bufPrintf(b, "            Subclass: %02Xh\n", a->subclass);
+                bufPrintf(b, "            Protocol: %02Xh\n", a->protocol);
+                if(a->description != NULL && a->description[0] != 0)
+                    bufPrintf(b, "            Description: %s\n", a->description);
+                bufPrintf(b, "            Endpoints (%i):\n", a->numEndpoints);
+                for(k = 0; k < a->numEndpoints; k++){
+                    usbEndpointInfo *e = &a->endpoints[k];
+
+                    bufPrintf(b, "              [%i] Endpoint: %i %02Xh %s %s", k, e->address, e->address,
+                              (e->address & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN ? "IN" : "OUT ",
+                              transferTypeName(e->attributes));
+                    if((e->attributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS)
+                        bufPrintf(b, " %s %s", syncTypeName(e->attributes), usageTypeName(e->attributes));
+                    bufPrintf(b, "\n");
+                    if(e->hasCompanion)
+                        bufPrintf(b, "                SuperSpeed companion: max burst %i, attributes %02Xh, %i bytes per interval\n",
+                                  e->maxBurst, e->companionAttributes, e->bytesPerInterval);
+                }
+            }
+        }
+    }
+    if(d->numCapabilities > 0){
+        bufPrintf(b, "  BOS capabilities (%i):\n", d->numCapabilities);
+        for(c = 0; c < d->numCapabilities; c++){
+            usbCapabilityInfo *cap = &d->capabilities[c];
+
+            bufPrintf(b, "    [%i] %s %02Xh:", c, capabilityName(cap->type), cap->type);
+            for(i = 0; i < cap->length; i++)
+                bufPrintf(b, " %02x", cap->data[i]);
+            bufPrintf(b, "\n");
+        }
+    }
+}
+
+static void jsonString(struct outBuffer *b, const char *s)
+{
+    if(s == NULL){
+        bufPrintf(b, "null");
+        return;
+    }
+    bufByte(b, '"');
+    for(; *s; s++){
+        if(*s == '"' || *s == '\\'){
+            bufByte(b, '\\');
+            bufByte(b, *s);
+        }else if((unsigned char)*s < 0x20){
+            bufPrintf(b, "\\u%04x", *s);
+        }else{
+            bufByte(b, *s);
+        }
+    }
+    bufByte(b, '"');
+}
+
+static void renderJson(struct outBuffer *b, usbDeviceInfo *d)
+{
+    struct libusb_device_descriptor *desc = &d->descriptor;
+    int c, i, j, k;
+
+    bufPrintf(b, "{\"bus\":%d,\"address\":%d,\"ports\":\"", d->bus, d->address);
+    for(i = 0; i < d->numPorts; i++)
+        bufPrintf(b, i > 0 ? ".%d" : "%d", d->ports[i]);
+    bufPrintf(b, "\",\"speed\":\"%s\",\"vendorId\":%d,\"productId\":%d,\"usb\":\"%x.%02x\","
+                 "\"version\":\"%x.%02x\",\"class\":%d,\"subclass\":%d,\"protocol\":%d,\"maxPacketSize0\":%d,",
+              speedName(d->speed), desc->idVendor, desc->idProduct, desc->bcdUSB >> 8, desc->bcdUSB & 0xff,
+              desc->bcdDevice >> 8, desc->bcdDevice & 0xff, desc->bDeviceClass, desc->bDeviceSubClass,
+              desc->bDeviceProtocol, desc->bMaxPacketSize0);
+    bufPrintf(b, "\"manufacturer\":");
+    jsonString(b, d->manufacturer);
+    bufPrintf(b, ",\"product\":");
+    jsonString(b, d->product);
+    bufPrintf(b, ",\"serial\":");
+    jsonString(b, d->serial);
+    bufPrintf(b, ",\"configurations\":[");
+    for(c = 0; c < d->numConfigs; c++){
+        usbConfigInfo *config = &d->configs[c];
+
+        if(config->interfaces == NULL){
+            bufPrintf(b, c > 0 ? ",null" : "null");
+            continue;
+        }
+        bufPrintf(b, "%s{\"value\":%d,\"attributes\":%d,\"maxPower\":%d,\"description\":",
+                  c > 0 ? "," : "", config->value, config->attributes, config->maxPower);
+        jsonString(b, config->description);
+        bufPrintf(b, ",\"interfaces\":[");
+        for(i = 0; i < config->numInterfaces; i++){
+            usbInterfaceInfo *inter = &config->interfaces[i];
+
+            bufPrintf(b, "%s{\"altsettings\":[", i > 0 ? "," : "");
+            for(j = 0; j < inter->numAltsettings; j++){
+                usbAltsettingInfo *a = &inter->altsettings[j];
+
+                bufPrintf(b, "%s{\"number\":%d,\"alternate\":%d,\"class\":%d,\"subclass\":%d,\"protocol\":%d,"
+                             "\"description\":", j > 0 ? "," : "", a->number, a->alternate,
+                          a->interfaceClass, a->subclass, a->protocol);
+                jsonString(b, a->description);
+                bufPrintf(b, ",\"endpoints\":[");
+                for(k = 0; k < a->numEndpoints; k++){
+                    usbEndpointInfo *e = &a->endpoints[k];
+
+                    bufPrintf(b, "%s{\"address\":%d,\"direction\":\"%s\",\"type\":\"%s\",\"attributes\":%d,"
+                                 "\"maxPacketSize\":%d,\"interval\":%d", k > 0 ? "," : "", e->address,
+                              (e->address & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN ? "in" : "out",
+                              transferTypeName(e->attributes), e->attributes, e->maxPacketSize, e->interval);
+                    if(e->hasCompanion)
+                        bufPrintf(b, ",\"companion\":{\"maxBurst\":%d,\"attributes\":%d,\"bytesPerInterval\":%d}",
+                                  e->maxBurst, e->companionAttributes, e->bytesPerInterval);
+                    bufPrintf(b, "}");
+                }
+                bufPrintf(b, "]}");
+            }
+            bufPrintf(b, "]}");
+        }
+        bufPrintf(b, "]}");
+    }
+    bufPrintf(b, "],\"bos\":[");
+    for(c = 0; c < d->numCapabilities; c++){
+        usbCapabilityInfo *cap = &d->capabilities[c];
+
+        bufPrintf(b, "%s{\"type\":%d,\"name\":\"%s\",\"data\":\"", c > 0 ? "," : "",
+                  cap->type, capabilityName(cap->type));
+        for(i = 0; i < cap->length; i++)
+            bufPrintf(b, "%02x", cap->data[i]);
+        bufPrintf(b, "\"}");
+    }
+    bufPrintf(b, "]}");
+}
+
+/* starts a binary record, returns the offset of its length field */
+static size_t   recordBegin(struct outBuffer *b, int tag)
+{
+    bufByte(b, tag);
+    bufWord(b, 0);
+    return b->len - 2;
+}
+
+static void recordEnd(struct outBuffer *b, size_t offset)
+{
+    size_t n = b->len - offset - 2;
+
+    if(!b->failed){
+        b->data[offset] = n & 0xff;
+        b->data[offset + 1] = (n >> 8) & 0xff;
+    }
+}
+
+static void renderBinary(struct outBuffer *b, usbDeviceInfo *d)
+{
+    struct libusb_device_descriptor *desc = &d->descriptor;
+    size_t r;
+    int c, i, j, k;
+
+    r = recordBegin(b, 'D');
+    bufByte(b, d->bus);
+    bufByte(b, d->address);
+    bufByte(b, d->speed);
+    bufByte(b, d->numPorts);
+    bufAppend(b, d->ports, d->numPorts);
+    bufWord(b, desc->idVendor);
+    bufWord(b, desc->idProduct);
+    bufWord(b, desc->bcdUSB);
+    bufWord(b, desc->bcdDevice);
+    bufByte(b, desc->bDeviceClass);
+    bufByte(b, desc->bDeviceSubClass);
+    bufByte(b, desc->bDeviceProtocol);
+    bufByte(b, desc->bMaxPacketSize0);
+    bufByte(b, d->numConfigs);
+    bufString(b, d->manufacturer);
+    bufString(b, d->product);
+    bufString(b, d->serial);
+    recordEnd(b, r);
+    for(c = 0; c < d->numConfigs; c++){
+        usbConfigInfo *config = &d->configs[c];
+
+        if(config->interfaces == NULL)
+            continue;
+        r = recordBegin(b, 'C');
+        bufByte(b, config->value);
+        bufByte(b, config->attributes);
+        bufByte(b, config->maxPower);
+        bufByte(b, config->numInterfaces);
+        bufString(b, config->description);
+        recordEnd(b, r);
+        for(i = 0; i < config->numInterfaces; i++){
+            usbInterfaceInfo *inter = &config->interfaces[i];
+
+            r = recordBegin(b, 'I');
+            bufByte(b, inter->numAltsettings);
+            recordEnd(b, r);
+            for(j = 0; j < inter->numAltsettings; j++){
+                usbAltsettingInfo *a = &inter->altsettings[j];
+
+                r = recordBegin(b, 'A');
+                bufByte(b, a->number);
+                bufByte(b, a->alternate);
+                bufByte(b, a->interfaceClass);
+                bufByte(b, a->subclass);
+                bufByte(b, a->protocol);
+                bufByte(b, a->numEndpoints);
+                bufString(b, a->description);
+                recordEnd(b, r);
+                for(k = 0; k < a->numEndpoints; k++){
+                    usbEndpointInfo *e = &a->endpoints[k];
+
+                    r = recordBegin(b, 'E');
+                    bufByte(b, e->address);
+                    bufByte(b, e->attributes);
+                    bufWord(b, e->maxPacketSize);
+                    bufByte(b, e->interval);
+                    recordEnd(b, r);
+                    if(e->hasCompanion){
+                        r = recordBegin(b, 'S');
+                        bufByte(b, e->maxBurst);
+                        bufByte(b, e->companionAttributes);
+                        bufWord(b, e->bytesPerInterval);
+                        recordEnd(b, r);
+                    }
+                }
+            }
+        }
+    }
+    for(c = 0; c < d->numCapabilities; c++){
+        r = recordBegin(b, 'B');
+        bufByte(b, d->capabilities[c].type);
+        bufAppend(b, d->capabilities[c].data, d->capabilities[c].length);
+        recordEnd(b, r);
+    }
+}
+
+int usbInfoWrite(usbInfo *info, int format, FILE *out)
+{
+    struct outBuffer b;
+    usbDeviceInfo *d;
+    int r = 0;
+
+    memset(&b, 0, sizeof(b));
+    bufReserve(&b, 65536);
+    if(format == USBINFO_JSON)
+        bufPrintf(&b, "[");
+    else if(format == USBINFO_BINARY)
+        bufAppend(&b, "UTI1", 4);
+    for(d = info->first; d != NULL; d = d->next){
+        switch(format){
+        case USBINFO_JSON:
+            bufPrintf(&b, d != info->first ? ",\n" : "\n");
+            renderJson(&b, d);
+            break;
+        case USBINFO_BINARY:
+            renderBinary(&b, d);
+            break;
+        default:
+            renderText(&b, d);
+        }
+    }
+    if(format == USBINFO_JSON)
+        bufPrintf(&b, "\n]\n");
+    if(b.failed){
+        errno = ENOMEM;
+        r = -1;
+    }else if(fwrite(b.data, 1, b.len, out) != b.len || fflush(out) != 0){
+        r = -1;
+    }
+    free(b.data);
+    return r;
+}
@@ -0,0 +1,139 @@
+/* Name: devinfo.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module collects the descriptors of USB devices into an in-memory tree
+and renders the tree as text, JSON or a compact binary snapshot. All nodes
+and strings of the tree live in one arena which is freed at once. The
+string descriptors of a device are requested concurrently with the
+asynchronous libusb-1.0 API instead of one after another. Rendering is a
+single pass into a memory buffer which is written out with one call.
+
+The binary snapshot starts with the 4 bytes "UTI1" followed by records,
+each made of a 1 byte tag, a 2 byte little endian payload length and the
+payload. Multi-byte values are little endian, strings are a 1 byte length
+followed by the characters. The records follow the tree order, each one
+belongs to the nearest preceding record of the enclosing level:
+  'D' device: bus, address, speed, number of ports, ports[], idVendor(2),
+      idProduct(2), bcdUSB(2), bcdDevice(2), class, subclass, protocol,
+      bMaxPacketSize0, bNumConfigurations, manufacturer, product, serial
+  'C' configuration: bConfigurationValue, bmAttributes, MaxPower,
+      bNumInterfaces, description
+  'I' interface: number of alternate settings
+  'A' alternate setting: bInterfaceNumber, bAlternateSetting, class,
+      subclass, protocol, bNumEndpoints, description
+  'E' endpoint: bEndpointAddress, bmAttributes, wMaxPacketSize(2), bInterval
+  'S' SuperSpeed endpoint companion: bMaxBurst, bmAttributes,
+      wBytesPerInterval(2)
+  'B' BOS device capability: bDevCapabilityType, data[]
+Readers should skip records with unknown tags.
+*/
+
+#ifndef __DEVINFO_H_INCLUDED__
+#define __DEVINFO_H_INCLUDED__
+
+#include <stdio.h>
+#include <libusb.h>
+
+/* output formats: */
+#define USBINFO_TEXT        1
+#define USBINFO_JSON        2
+#define USBINFO_BINARY      3
+
+typedef struct usbEndpointInfo {
+    int                     address;
+    int                     attributes;
+    int                     maxPacketSize;
+    int                     interval;
+    int                     hasCompanion;   /* the following three are valid */
+    int                     maxBurst;
+    int                     companionAttributes;
+    int                     bytesPerInterval;
+} usbEndpointInfo;
+
+typedef struct usbAltsettingInfo {
+    int                     number;         /* bInterfaceNumber */
+    int                     alternate;
+    int                     interfaceClass;
+    int                     subclass;
+    int                     protocol;
+    int                     descriptionIndex;
+    char                    *description;   /* NULL if none */
+    int                     numEndpoints;
+    usbEndpointInfo         *endpoints;
+} usbAltsettingInfo;
+
+typedef struct usbInterfaceInfo {
+    int                     numAltsettings;
+    usbAltsettingInfo       *altsettings;
+} usbInterfaceInfo;
+
+typedef struct usbConfigInfo {
+    int                     value;
+    int                     attributes;
+    int                     maxPower;
+    int                     descriptionIndex;
+    char                    *description;   /* NULL if none */
+    int                     numInterfaces;
+    usbInterfaceInfo        *interfaces;    /* NULL if not readable */
+} usbConfigInfo;
+
+typedef struct usbCapabilityInfo {
+    int                     type;
+    int                     length;
+    unsigned char           *data;
+} usbCapabilityInfo;
+
+typedef struct usbDeviceInfo {
+    int                     bus;
+    int                     address;
+    int                     speed;          /* enum libusb_speed */
+    int                     numPorts;
+    unsigned char           ports[8];
+    struct libusb_device_descriptor descriptor;
+    char                    *manufacturer;  /* "" if none */
+    char                    *product;
+    char                    *serial;
+    int                     numConfigs;
+    usbConfigInfo           *configs;
+    int                     numCapabilities;    /* of the BOS descriptor */
+    usbCapabilityInfo       *capabilities;
+    struct usbDeviceInfo    *next;
+} usbDeviceInfo;
+
+typedef struct usbInfo usbInfo;
+
+usbInfo *usbInfoNew(void);
+/* Creates an empty device tree.
+ * Returns: the tree or NULL if memory is exhausted.
+ */
+
+usbDeviceInfo *usbInfoAdd(usbInfo *info, libusb_device *dev, libusb_device_handle *handle,
+                          const char *manufacturer, const char *product, const char *serial,
+                          FILE *warningsFp);
+/* Reads the descriptors of 'dev' and adds them to the tree. The manufacturer,
+ * product and serial strings already known to the caller are passed in the
+ * corresponding arguments, the other strings are requested through 'handle'
+ * (all at the same time). If 'handle' is NULL, strings and the BOS
+ * descriptor are left out. Warnings are printed to 'warningsFp' if it is not
+ * NULL.
+ * Returns: the new device node or NULL on error.
+ */
+
+int usbInfoWrite(usbInfo *info, int format, FILE *out);
+/* Renders all devices of the tree in the given format (USBINFO_*) and
+ * writes the result to 'out'.
+ * Returns: 0 on success or -1 on error (errno is set).
+ */
+
+void usbInfoFree(usbInfo *info);
+/* Frees the tree with all of its nodes. */
+
+#endif /* __DEVINFO_H_INCLUDED__ */
@@ -0,0 +1,341 @@
+/* Name: download.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Pipelined block-wise control-out download with optional read-back.
+See download.h for the interface.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "download.h"
+#include "trace.h"
+
+extern libusb_context* usbCtx;
+
+/* ------------------------------------------------------------------------- */
+
+#define PHASE_WRITE     0
+#define PHASE_VERIFY    1
+
+struct downloadSlot {
+    struct libusb_transfer  *transfer;
+    usbDownload             *download;
+    long                    block;
+    int                     phase;
+    long long               submitNs;
+    int                     active;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+#define DOWNLOAD_MAX_FAILURES   10  /* event handling failures in a row before giving up */
+
+static long         nextBlock;      /* next block to submit */
+static long         numBlocks;
+static int          inFlight;
+static int          stopping;
+static int          downloadError;
+static long long    startNs;
+static long long    progressNs;     /* last progress output */
+
+void usbDownloadStop(void)
+{
+    stopRequested = 1;
+}
+
+int usbDownloadParseAddress(char *spec, int *addressing, long *step)
+{
+    char *colon = strchr(spec, ':'), *end;
+    size_t len = colon != NULL ? colon - spec : strlen(spec);
+
+    *step = 0;
+    if(colon != NULL){
+        *step = strtol(colon + 1, &end, 0);
+        if(end == colon + 1 || *end != 0)
+            return -1;
+    }
+    if(len == 4 && strncasecmp(spec, "none", len) == 0){
+        *addressing = DOWNLOAD_ADDRESS_NONE;
+    }else if(len == 5 && strncasecmp(spec, "value", len) == 0){
+        *addressing = DOWNLOAD_ADDRESS_VALUE;
+    }else if(len == 5 && strncasecmp(spec, "index", len) == 0){
+        *addressing = DOWNLOAD_ADDRESS_INDEX;
+    }else if(len == 4 && strncasecmp(spec, "long", len) == 0){
+        *addressing = DOWNLOAD_ADDRESS_LONG;
+    }else{
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void blockAddress(usbDownload *d, long block, int *value, int *index)
+{
+    long step = d->step != 0 ? d->step : d->blockSize;
+    unsigned long address;
+
+    *value = d->value;
+    *index = d->index;
+    switch(d->addressing){
+    case DOWNLOAD_ADDRESS_VALUE:
+        *value = d->value + block * step;
+        break;
+    case DOWNLOAD_ADDRESS_INDEX:
+        *index = d->index + block * step;
+        break;
+    case DOWNLOAD_ADDRESS_LONG:
+        address = (((unsigned long)d->index & 0xffff) << 16 | (d->value & 0xffff)) + block * step;
+        *value = address;
+        *index = address >> 16;
+        break;
+    }
+    *value &= 0xffff;
+    *index &= 0xffff;
+}
+
+/* Returns: non-zero if the address of the last block fits into the
+ * address scheme, which would wrap around otherwise.
+ */
+static int  addressesFit(usbDownload *d)
+{
+    long long step = d->step != 0 ? d->step : d->blockSize, first, last, max = 0xffff;
+
+    switch(d->addressing){
+    case DOWNLOAD_ADDRESS_VALUE:
+        first = d->value & 0xffff;
+        break;
+    case DOWNLOAD_ADDRESS_INDEX:
+        first = d->index & 0xffff;
+        break;
+    case DOWNLOAD_ADDRESS_LONG:
+        first = ((long long)d->index & 0xffff) << 16 | (d->value & 0xffff);
+        max = 0xffffffffLL;
+        break;
+    default:
+        return 1;
+    }
+    last = first + (numBlocks > 0 ? numBlocks - 1 : 0) * step;
+    return last >= 0 && last <= max;
+}
+
+static int  blockLength(usbDownload *d, long block)
+{
+    long long left = d->size - (long long)block * d->blockSize;
+
+    return left < d->blockSize ? left : d->blockSize;
+}
+
+static int  submitPhase(struct downloadSlot *slot, long block, int phase)
+{
+    usbDownload *d = slot->download;
+    int value, index, len = blockLength(d, block), r;
+
+    blockAddress(d, block, &value, &index);
+    if(phase == PHASE_WRITE){
+        libusb_fill_control_setup(slot->transfer->buffer, d->requestType & 0x7f, d->request & 0xff,
+                                  value, index, len);
+        memcpy(slot->transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+               d->data + (long long)block * d->blockSize, len);
+        slot->submitNs = statsClockNs();
+    }else{
+        libusb_fill_control_setup(slot->transfer->buffer, (d->requestType & 0x7f) | LIBUSB_ENDPOINT_IN,
+                                  d->verifyRequest & 0xff, value, index, len);
+    }
+    libusb_fill_control_transfer(slot->transfer, d->handle, slot->transfer->buffer,
+                                 slot->transfer->callback, slot, d->timeout);
+    if((r = libusb_submit_transfer(slot->transfer)) < 0)
+        return r;
+    if(phase == PHASE_WRITE)
+        traceEvent(TRACE_SUBMIT, block);   /* only once submitted, to pair with its completion */
+    slot->block = block;
+    slot->phase = phase;
+    slot->active = 1;
+    inFlight++;
+    STATS_ADD(d->stats.inFlight, 1);
+    return 0;
+}
+
+static void printProgress(usbDownload *d, int final)
+{
+    long long now = statsClockNs(), done = STATS_GET(d->stats.bytes);
+    double seconds = (now - startNs) / 1e9;
+
+    if(d->progressFp == NULL || (!final && now - progressNs < 200000000LL))
+        return;
+    progressNs = now;
+    fprintf(d->progressFp, "\r%lld of %lld bytes (%d%%), %.1f kB/s", done, d->size,
+            d->size > 0 ? (int)(done * 100 / d->size) : 100,
+            seconds > 0 ? done / seconds / 1000 : 0.0);
+    if(final)
+        fprintf(d->progressFp, "\n");
+    fflush(d->progressFp);
+}
+
+static void LIBUSB_CALL blockDone(struct libusb_transfer *transfer)
+{
+    struct downloadSlot *slot = transfer->user_data;
+    usbDownload *d = slot->download;
+    int len = blockLength(d, slot->block), r;
+    int traced = slot->phase == PHASE_WRITE;   /* the slot is reused below */
+    long block = slot->block;
+
+    if(traced)
+        traceEvent(TRACE_COMPLETE, block);
+    slot->active = 0;
+    inFlight--;
+    STATS_ADD(d->stats.inFlight, -1);
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED){
+        if(transfer->status != LIBUSB_TRANSFER_CANCELLED){
+            STATS_ADD(d->stats.errors, 1);
+            if(transfer->status == LIBUSB_TRANSFER_TIMED_OUT){
+                STATS_ADD(d->stats.timeouts, 1);
+                downloadError = LIBUSB_ERROR_TIMEOUT;
+            }else if(transfer->status == LIBUSB_TRANSFER_STALL){
+                STATS_ADD(d->stats.stalls, 1);
+                downloadError = LIBUSB_ERROR_PIPE;
+            }else if(transfer->status == LIBUSB_TRANSFER_NO_DEVICE){
+                downloadError = LIBUSB_ERROR_NO_DEVICE;
+            }else{
+                downloadError = LIBUSB_ERROR_IO;
+            }
+        }
+        stopping = 1;
+    }else if(transfer->actual_length != len){
+        STATS_ADD(d->stats.errors, 1);
+        fprintf(stderr, "\nBlock %ld: %d of %d bytes %s.\n", slot->block, transfer->actual_length,
+                len, slot->phase == PHASE_WRITE ? "sent" : "read back");
+        downloadError = LIBUSB_ERROR_IO;
+        stopping = 1;
+    }else if(slot->phase == PHASE_WRITE){
+        STATS_ADD(d->stats.bytes, len);
+        if(d->verify && !stopping){
+            if((r = submitPhase(slot, slot->block, PHASE_VERIFY)) < 0){
+                downloadError = r;
+                stopping = 1;
+            }
+            goto done;
+        }
+    }else if(memcmp(libusb_control_transfer_get_data(transfer),
+                    d->data + (long long)slot->block * d->blockSize, len) != 0){
+        STATS_ADD(d->stats.errors, 1);
+        fprintf(stderr, "\nBlock %ld (offset %lld) doesn't match when read back.\n",
+                slot->block, (long long)slot->block * d->blockSize);
+        downloadError = LIBUSB_ERROR_OTHER;
+        stopping = 1;
+    }
+    /* a block is done when its last phase is (a write skipped its read-back when stopping) */
+    if(!slot->active && transfer->status == LIBUSB_TRANSFER_COMPLETED && downloadError == 0
+       && (!d->verify || slot->phase == PHASE_VERIFY)){
+        statsAddLatency(&d->stats, statsClockNs() - slot->submitNs);
+        STATS_ADD(d->stats.transfers, 1);
+    }
+    if(!stopping && !stopRequested && nextBlock < numBlocks){
+        if((r = submitPhase(slot, nextBlock++, PHASE_WRITE)) < 0){
+            downloadError = r;
+            stopping = 1;
+        }
+    }
+done:
+    printProgress(d, 0);
+    if(traced)
+        traceEvent(TRACE_CALLBACK_RETURN, block);
+}
+
+/* ------------------------------------------------------------------------- */
+
+int usbDownloadRun(usbDownload *d)
+{
+    struct downloadSlot *slots;
+    int i, n, r, cancelled = 0, failures = 0;
+
+    if(d->blockSize < 1 || d->blockSize > 0xffff)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    numBlocks = (d->size + d->blockSize - 1) / d->blockSize;
+    if(!addressesFit(d)){
+        fprintf(stderr, "The addresses of %ld blocks don't fit into %d bits, the last ones would wrap around.\n",
+                numBlocks, d->addressing == DOWNLOAD_ADDRESS_LONG ? 32 : 16);
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    n = d->depth < 1 ? 1 : d->depth;
+    if(numBlocks < n)
+        n = numBlocks;
+    nextBlock = 0;
+    inFlight = 0;
+    stopping = 0;
+    downloadError = 0;
+    startNs = progressNs = statsClockNs();
+    if((slots = calloc(n > 0 ? n : 1, sizeof(*slots))) == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    for(i = 0; i < n; i++){
+        unsigned char *buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + d->blockSize);
+
+        if(buffer == NULL || (slots[i].transfer = libusb_alloc_transfer(0)) == NULL){
+            free(buffer);
+            downloadError = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+        slots[i].download = d;
+        libusb_fill_control_transfer(slots[i].transfer, d->handle, NULL, blockDone, &slots[i], d->timeout);
+        slots[i].transfer->buffer = buffer;
+    }
+    for(i = 0; i < n && downloadError == 0 && !stopRequested; i++){
+        if((r = submitPhase(&slots[i], nextBlock++, PHASE_WRITE)) < 0)
+            downloadError = r;
+    }
+    if(downloadError != 0)
+        stopping = 1;
+
+    while(inFlight > 0){
+        struct timeval tv = { 0, 100000 };
+
+        if((stopping || stopRequested) && !cancelled){
+            for(i = 0; i < n; i++){
+                if(slots[i].active)
+                    libusb_cancel_transfer(slots[i].transfer);
+            }
+            cancelled = 1;
+        }
+        r = libusb_handle_events_timeout_completed(usbCtx, &tv, NULL);
+        if(r < 0 && r != LIBUSB_ERROR_INTERRUPTED){
+            /* cancel everything and go on reaping the transfers */
+            if(downloadError == 0)
+                downloadError = r;
+            stopping = 1;
+            if(++failures > DOWNLOAD_MAX_FAILURES){
+                /* The transfers still in flight can't be reaped, so they
+                 * and the slots they refer to are left allocated.
+                 */
+                return downloadError;
+            }
+        }else{
+            failures = 0;
+        }
+    }
+    printProgress(d, 1);
+
+    for(i = 0; i < n; i++){
+        if(slots[i].transfer != NULL){
+            free(slots[i].transfer->buffer);
+            libusb_free_transfer(slots[i].transfer);
+        }
+    }
+    free(slots);
+    if(downloadError == 0 && stopRequested && nextBlock < numBlocks)
+        downloadError = LIBUSB_ERROR_INTERRUPTED;
+    return downloadError;
+}
@@ -0,0 +1,73 @@
+/* Name: download.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module downloads data of any size to a device with a sequence of
+control-out requests. The data is split into blocks of at most 'blockSize'
+bytes (the wLength of each request) and the value and index fields are
+advanced from block to block according to an address scheme. Several
+requests are kept in flight using the asynchronous libusb-1.0 API, and
+each block can be read back with a control-in request and compared.
+*/
+
+#ifndef __DOWNLOAD_H_INCLUDED__
+#define __DOWNLOAD_H_INCLUDED__
+
+#include <stdio.h>
+#include <libusb.h>
+#include "stats.h"
+
+/* address schemes: */
+#define DOWNLOAD_ADDRESS_NONE   0   /* value and index stay the same */
+#define DOWNLOAD_ADDRESS_VALUE  1   /* value advances by 'step' per block */
+#define DOWNLOAD_ADDRESS_INDEX  2   /* index advances by 'step' per block */
+#define DOWNLOAD_ADDRESS_LONG   3   /* (index << 16 | value) advances by 'step' */
+
+typedef struct usbDownload {
+    /* parameters, filled in by the caller: */
+    libusb_device_handle    *handle;
+    int                     requestType;    /* type and recipient, direction is set as needed */
+    int                     request;
+    int                     value;          /* of the first block */
+    int                     index;          /* of the first block */
+    int                     addressing;     /* DOWNLOAD_ADDRESS_* */
+    long                    step;           /* address increment, 0 for the block size */
+    unsigned char           *data;
+    long long               size;
+    int                     blockSize;      /* at most 0xffff */
+    int                     depth;          /* number of requests in flight */
+    unsigned int            timeout;        /* per request, in milliseconds */
+    int                     verify;         /* read back and compare each block */
+    int                     verifyRequest;  /* request used to read back */
+    FILE                    *progressFp;    /* progress is printed here if not NULL */
+    /* counters, updated by usbDownloadRun() (see stats.h): */
+    usbStats                stats;
+} usbDownload;
+
+int usbDownloadParseAddress(char *spec, int *addressing, long *step);
+/* Parses an address scheme of the form "none", "value", "index" or "long"
+ * with an optional ":<step>" suffix.
+ * Returns: 0 on success or -1 if the specification is invalid.
+ */
+
+int usbDownloadRun(usbDownload *download);
+/* This function downloads the data block by block until all blocks are
+ * done, usbDownloadStop() is called or an error occurs. In-flight requests
+ * are cancelled and reaped before the function returns.
+ * Returns: 0 on success or a negative libusb error code. A block which
+ * doesn't match when read back gives LIBUSB_ERROR_OTHER.
+ */
+
+void usbDownloadStop(void);
+/* Requests the running download to stop. This function is
+ * async-signal-safe and may be called from a signal handler.
+ */
+
+#endif /* __DOWNLOAD_H_INCLUDED__ */
@@ -0,0 +1,235 @@
+/* Name: frame.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Reassembly of received transfers into messages and their output as records.
+See frame.h for the interface.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "frame.h"
+
+#define FRAME_OUTPUT    65536   /* output is passed on in pieces of this size */
+
+static usbSinkWriter    output;
+static void             *outputContext;
+static int              transferSize;
+static int              format;
+static int              timestamps;
+static usbStats         *stats;
+static long long        clockOffset;    /* CLOCK_REALTIME - statsClockNs() */
+static unsigned char    *message;       /* the message being reassembled */
+static size_t           messageLen;
+static size_t           messageSize;
+static int              continued;      /* part of the message has been written (split) */
+static long long        lastEndNs;      /* end of the previous message, 0 if none */
+static unsigned char    *outBuffer;
+static size_t           outLen;
+static long             outSeq;         /* last transfer, passed to 'output' for tracing */
+static int              failed;
+
+/* ------------------------------------------------------------------------- */
+
+static void flushOutput(void)
+{
+    if(outLen > 0 && !failed && output(outputContext, outSeq, outBuffer, outLen) != 0)
+        failed = 1;
+    outLen = 0;
+}
+
+static void put(const void *data, size_t len)
+{
+    if(len > FRAME_OUTPUT - outLen)
+        flushOutput();
+    if(len >= FRAME_OUTPUT){    /* large data is passed on directly */
+        if(!failed && output(outputContext, outSeq, (unsigned char *)data, len) != 0)
+            failed = 1;
+        return;
+    }
+    memcpy(outBuffer + outLen, data, len);
+    outLen += len;
+}
+
+static void putHex(unsigned int lengthFlags, const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    char text[5 * 256];
+    size_t i, n = 0;
+
+    if(lengthFlags & FRAME_GAP){
+        n = snprintf(text, sizeof(text), "# gap before transfer %ld\n", outSeq);
+        put(text, n);
+        return;
+    }
+    for(i = 0; i < len; i++){
+        if(n > sizeof(text) - 5){
+            put(text, n);
+            n = 0;
+        }
+        if(i != 0)
+            text[n++] = ' ';
+        text[n++] = '0';
+        text[n++] = 'x';
+        text[n++] = digits[data[i] >> 4];
+        text[n++] = digits[data[i] & 15];
+    }
+    put(text, n);
+    if(lengthFlags & FRAME_SPLIT)
+        put(" ...", 4);
+    put("\n", 1);
+}
+
+/* writes one record (or line) holding 'len' bytes of 'data' */
+static void putRecord(unsigned int lengthFlags, long long ns, const unsigned char *data, size_t len)
+{
+    unsigned char header[12];
+    int i;
+
+    if(format == FRAME_HEX){
+        if(timestamps){
+            char text[32];
+            long long t = ns + clockOffset;
+
+            put(text, snprintf(text, sizeof(text), "%lld.%09lld ", t / 1000000000LL, t % 1000000000LL));
+        }
+        putHex(lengthFlags, data, len);
+        return;
+    }
+    lengthFlags |= len;
+    for(i = 0; i < 4; i++)
+        header[i] = lengthFlags >> (8 * i);
+    if(timestamps){
+        unsigned long long t = ns + clockOffset;
+
+        for(i = 0; i < 8; i++)
+            header[4 + i] = t >> (8 * i);
+    }
+    put(header, timestamps ? 12 : 4);
+    if(len > 0)
+        put(data, len);
+}
+
+/* writes the reassembled data as a complete message or, with 'split', as
+ * the first part of a message
+ */
+static void endMessage(long long ns, int split)
+{
+    putRecord(split ? FRAME_SPLIT : 0, ns, message, messageLen);
+    messageLen = 0;
+    continued = split;
+    if(!split){
+        STATS_ADD(stats->messages, 1);
+        if(lastEndNs != 0)
+            statsAddInterval(stats, ns - lastEndNs);
+        lastEndNs = ns;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+int frameStart(usbSinkWriter outputFunc, void *context, int size, int outputFormat,
+               int withTimestamps, usbStats *counters)
+{
+    struct timespec ts;
+
+    output = outputFunc;
+    outputContext = context;
+    transferSize = size;
+    format = outputFormat;
+    timestamps = withTimestamps;
+    stats = counters;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    clockOffset = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec - statsClockNs();
+    messageLen = 0;
+    messageSize = 4 * (size_t)size;
+    continued = 0;
+    lastEndNs = 0;
+    outLen = 0;
+    outSeq = 0;
+    failed = 0;
+    message = malloc(messageSize);
+    outBuffer = malloc(FRAME_OUTPUT);
+    if(message == NULL || outBuffer == NULL){
+        free(message);
+        free(outBuffer);
+        message = outBuffer = NULL;
+        return -1;
+    }
+    if(format == FRAME_RECORDS){
+        unsigned char header[8] = { 'U', 'T', 'M', '1', timestamps ? 1 : 0, 0, 0, 0 };
+
+        put(header, sizeof(header));
+    }
+    return 0;
+}
+
+int frameWrite(void *context, long seq, unsigned char *data, int len)
+{
+    long long ns;
+    int flags, ends = len < transferSize;
+    size_t n;
+
+    ns = sinkEntryTime(&flags);
+    outSeq = seq;
+    if(data == NULL){   /* data has been lost: drop the incomplete message */
+        if(messageLen > 0 || continued)
+            STATS_ADD(stats->messagesDropped, 1);
+        messageLen = 0;
+        continued = 0;
+        putRecord(FRAME_GAP, ns, NULL, 0);
+        return failed ? -1 : 0;
+    }
+    while(len > 0){
+        n = FRAME_MAX_RECORD - messageLen;
+        if(n > len)
+            n = len;
+        if(messageLen + n > messageSize){
+            unsigned char *p;
+            size_t size = messageSize;
+
+            while(size < messageLen + n)
+                size *= 2;
+            if((p = realloc(message, size)) == NULL){
+                failed = 1;
+                return -1;
+            }
+            message = p;
+            messageSize = size;
+        }
+        memcpy(message + messageLen, data, n);
+        messageLen += n;
+        data += n;
+        len -= n;
+        if(messageLen == FRAME_MAX_RECORD)
+            endMessage(ns, 1);
+    }
+    /* a transfer cut short by a timeout doesn't end the message */
+    if(ends && !(flags & SINK_PARTIAL))
+        endMessage(ns, 0);
+    return failed ? -1 : 0;
+}
+
+int frameStop(void)
+{
+    if(outBuffer == NULL)
+        return 0;
+    if(messageLen > 0 || continued)
+        STATS_ADD(stats->messagesDropped, 1);
+    flushOutput();
+    free(message);
+    free(outBuffer);
+    message = outBuffer = NULL;
+    return failed ? -1 : 0;
+}
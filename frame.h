@@ -0,0 +1,68 @@
+/* Name: frame.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module reassembles the data of an IN stream into the messages sent by
+the device. A message ends with a short packet or a zero length packet, so
+it ends with the first transfer which is not filled completely; this works
+with any number of transfers in flight because they complete in order. The
+module runs as the writer function of the output sink (see sink.h) and
+passes the messages on either as binary records or as hex text lines.
+
+The binary output starts with the 4 bytes "UTM1", 1 byte of flags (bit 0:
+the records carry timestamps) and 3 zero bytes. Each record that follows
+is made of:
+  length        4 bytes, little endian: bits 0 to 29 are the number of data
+                bytes, bit 30 (FRAME_GAP) marks lost data in front of the
+                record, bit 31 (FRAME_SPLIT) marks a part of a message too
+                long for one record, continued in the next record
+  timestamp     8 bytes, little endian, only if bit 0 of the flags is set:
+                the time the last transfer of the message completed, in
+                nanoseconds since 1970-01-01 UTC
+  data          the bytes of the message
+A gap record has no data.
+*/
+
+#ifndef __FRAME_H_INCLUDED__
+#define __FRAME_H_INCLUDED__
+
+#include "sink.h"
+#include "stats.h"
+
+#define FRAME_RECORDS       0   /* binary records */
+#define FRAME_HEX           1   /* one text line per message */
+
+#define FRAME_GAP           0x40000000U
+#define FRAME_SPLIT         0x80000000U
+#define FRAME_MAX_RECORD    (16 * 1024 * 1024)  /* longer messages are split */
+
+int frameStart(usbSinkWriter output, void *context, int transferSize, int format,
+               int timestamps, usbStats *stats);
+/* This function starts reassembling the data of transfers of 'transferSize'
+ * bytes, which must be a multiple of the maximum packet size of the
+ * endpoint. The output in the given format (FRAME_RECORDS or FRAME_HEX) is
+ * passed to 'output' with 'context' in pieces of any size. If 'timestamps'
+ * is non-zero, the completion time is written with each message. The
+ * message counters and intervals are updated in 'stats'.
+ * Returns: 0 on success or -1 if memory is exhausted.
+ */
+
+int frameWrite(void *context, long seq, unsigned char *data, int len);
+/* The writer function to pass to sinkStart() (usbSinkWriter). 'context' is
+ * not used.
+ */
+
+int frameStop(void);
+/* Writes out the buffered output and frees the buffers. An incomplete
+ * message at the end is dropped.
+ * Returns: 0 on success or -1 if 'output' has failed.
+ */
+
+#endif /* __FRAME_H_INCLUDED__ */
@@ -11,13 +11,14 @@
 /*
 General Description:
 This module offers additional functionality for host side drivers based on
-libusb-1.0. It includes a function to find and open a device
-based on numeric IDs and textual description. It also includes a function to
-obtain textual descriptions from a device.
+libusb-1.0. It includes a function to find and open a device based on
+numeric IDs and textual description. It also includes a function to obtain
+textual descriptions from a device.
 
-To use this functionality, simply copy opendevice.c and opendevice.h into your
-project and add them to your Makefile. You may modify and redistribute these
-files according to the GNU General Public License (GPL) version 2 or 3.
+To use this functionality, simply copy opendevice.c, opendevice.h, pattern.c,
+pattern.h, devinfo.c and devinfo.h into your project and add them to your
+Makefile. You may modify and redistribute these files according to the GNU
+General Public License (GPL) version 2 or 3.
 */
 
 #ifndef __OPENDEVICE_H_INCLUDED__
@@ -50,10 +51,16 @@ int usbOpenDevice(libusb_device_handle **device, int vendorID, char *vendorNameP
  * of characters in square brackets for a single character from the list
  * (dashes are allowed to specify a range) and if the lis of characters begins
  * with a caret ('^'), it matches one character which is NOT in the list.
+ * Each pattern argument may be a comma separated list of patterns, a string
+ * matches if it matches any of them (see pattern.h). The lists are compiled
+ * once per call and matched in linear time.
  * Other parameters to the function: If 'warningsFp' is not NULL, warning
  * messages are printed to this file descriptor with fprintf(). If
  * 'printMatchingDevicesFp' is not NULL, no device is opened but matching
- * devices are printed to the given file descriptor with fprintf().
+ * devices are printed to the given file descriptor with fprintf(). If
+ * 'verbose' is not 0, the descriptors of the matching devices are printed as
+ * well, in the format given by 'verbose' (USBINFO_TEXT, USBINFO_JSON or
+ * USBINFO_BINARY, see devinfo.h), all at once after the search.
  * If a device is opened, the resulting USB handle is stored in '*device'. A
  * pointer to a "usb_dev_handle *" type variable must be passed here.
  * Returns: 0 on success, an error code (see defines below) on failure.
@@ -62,7 +69,7 @@ int usbOpenDevice(libusb_device_handle **device, int vendorID, char *vendorNameP
 /* usbOpenDevice() error codes: */
 #define USBOPEN_SUCCESS         0   /* no error */
 #define USBOPEN_ERR_ACCESS      1   /* not enough permissions to open device */
-#define USBOPEN_ERR_IO          2   /* I/O error */
+#define USBOPEN_ERR_IO          2   /* I/O error or out of memory */
 #define USBOPEN_ERR_NOTFOUND    3   /* device not found */
 
 
@@ -0,0 +1,321 @@
+/* Name: pattern.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Shell style pattern sets compiled into a lazily built DFA.
+See pattern.h for the interface.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "pattern.h"
+
+/* NFA states, one per pattern position: */
+#define ITEM_LITERAL    0   /* one given character */
+#define ITEM_ANY        1   /* '?' */
+#define ITEM_CLASS      2   /* '[...]' */
+#define ITEM_STAR       3   /* '*', loops on any character */
+#define ITEM_ACCEPT     4   /* end of a pattern */
+
+#define DFA_MAX_STATES  256     /* the cache is flushed when full */
+#define DFA_BUCKETS     512
+
+#define WORD_BITS       (8 * sizeof(unsigned long))
+
+struct patternItem {
+    unsigned char   type;
+    unsigned char   c;      /* ITEM_LITERAL */
+    int             cls;    /* ITEM_CLASS: index into 'classes' */
+};
+
+struct dfaState {
+    int             next[256];  /* -1 if not computed yet */
+    int             accepting;
+    int             dead;       /* no NFA state left, nothing can match */
+    unsigned int    hash;
+    int             chain;      /* next state in the same bucket */
+};
+
+struct usbPattern {
+    struct patternItem  *items;
+    int                 numItems;
+    unsigned char       (*classes)[32];
+    int                 words;      /* size of a state set in words */
+    unsigned long       *startSet;
+    unsigned long       *scratch;
+    struct dfaState     *states;
+    unsigned long       *sets;      /* NFA state set of each DFA state */
+    int                 numStates;
+    int                 generation; /* incremented when the cache is flushed */
+    int                 buckets[DFA_BUCKETS];
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Finds the end of a character class starting after '['. Returns a pointer
+ * to the closing ']' or NULL if there is none.
+ */
+static const char   *classEnd(const char *p)
+{
+    if(*p == '^')
+        p++;
+    if(*p == ']' || *p == '-')
+        p++;
+    while(*p && *p != ']')
+        p++;
+    return *p ? p : NULL;
+}
+
+/* Fills the bitmap of the class between 'p' (after '[') and 'end'. */
+static void parseClass(unsigned char *bits, const char *p, const char *end)
+{
+    int reverse = *p == '^', last, c, i;
+
+    memset(bits, 0, 32);
+    if(reverse)
+        p++;
+    if(*p == ']' || *p == '-'){
+        c = (unsigned char)*p++;
+        bits[c >> 3] |= 1 << (c & 7);
+    }
+    for(last = (unsigned char)p[-1]; p < end; last = (unsigned char)*p++){
+        if(*p == '-' && p + 1 < end){
+            p++;
+            for(c = last; c <= (unsigned char)*p; c++)
+                bits[c >> 3] |= 1 << (c & 7);
+        }else{
+            c = (unsigned char)*p;
+            bits[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    if(reverse){
+        for(i = 0; i < 32; i++)
+            bits[i] = ~bits[i];
+    }
+}
+
+static void addItem(usbPattern *pattern, int type, int c, int cls)
+{
+    struct patternItem *item = &pattern->items[pattern->numItems++];
+
+    item->type = type;
+    item->c = c;
+    item->cls = cls;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* adds NFA state 'i' and its epsilon closure to 'set' */
+static void addState(usbPattern *pattern, unsigned long *set, int i)
+{
+    set[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+    if(pattern->items[i].type == ITEM_STAR) /* stars are collapsed, so one step is enough */
+        set[(i + 1) / WORD_BITS] |= 1UL << ((i + 1) % WORD_BITS);
+}
+
+static unsigned int setHash(usbPattern *pattern, unsigned long *set)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for(i = 0; i < pattern->words; i++)
+        h = (h ^ (unsigned int)(set[i] ^ (set[i] >> 31 >> 1))) * 16777619u;
+    return h;
+}
+
+static void flushStates(usbPattern *pattern)
+{
+    int i;
+
+    pattern->numStates = 0;
+    pattern->generation++;
+    for(i = 0; i < DFA_BUCKETS; i++)
+        pattern->buckets[i] = -1;
+}
+
+/* returns the DFA state for the NFA state set 'set', adding it if needed */
+static int  findState(usbPattern *pattern, unsigned long *set)
+{
+    unsigned int h = setHash(pattern, set);
+    struct dfaState *state;
+    unsigned long *copy;
+    int i, s, empty = 1;
+
+    for(s = pattern->buckets[h % DFA_BUCKETS]; s >= 0; s = pattern->states[s].chain){
+        if(pattern->states[s].hash == h
+           && memcmp(&pattern->sets[s * pattern->words], set, pattern->words * sizeof(*set)) == 0)
+            return s;
+    }
+    if(pattern->numStates == DFA_MAX_STATES){
+        flushStates(pattern);
+        findState(pattern, pattern->startSet); /* keep the start state at 0 */
+    }
+    s = pattern->numStates++;
+    state = &pattern->states[s];
+    copy = &pattern->sets[s * pattern->words];
+    memcpy(copy, set, pattern->words * sizeof(*set));
+    for(i = 0; i < 256; i++)
+        state->next[i] = -1;
+    state->accepting = 0;
+    for(i = 0; i < pattern->numItems; i++){
+        if(copy[i / WORD_BITS] & (1UL << (i % WORD_BITS))){
+            empty = 0;
+            if(pattern->items[i].type == ITEM_ACCEPT)
+                state->accepting = 1;
+        }
+    }
+    state->dead = empty;
+    state->hash = h;
+    state->chain = pattern->buckets[h % DFA_BUCKETS];
+    pattern->buckets[h % DFA_BUCKETS] = s;
+    return s;
+}
+
+/* computes the transition of DFA state 's' on character 'c' */
+static int  step(usbPattern *pattern, int s, int c)
+{
+    unsigned long *set = &pattern->sets[s * pattern->words], *next = pattern->scratch;
+    struct patternItem *item;
+    int i;
+
+    memset(next, 0, pattern->words * sizeof(*next));
+    for(i = 0; i < pattern->numItems; i++){
+        if(!(set[i / WORD_BITS] & (1UL << (i % WORD_BITS)))){
+            if(set[i / WORD_BITS] == 0)     /* skip empty words */
+                i |= WORD_BITS - 1;
+            continue;
+        }
+        item = &pattern->items[i];
+        switch(item->type){
+        case ITEM_LITERAL:
+            if(item->c == c)
+                addState(pattern, next, i + 1);
+            break;
+        case ITEM_ANY:
+            addState(pattern, next, i + 1);
+            break;
+        case ITEM_CLASS:
+            if(pattern->classes[item->cls][c >> 3] & (1 << (c & 7)))
+                addState(pattern, next, i + 1);
+            break;
+        case ITEM_STAR:
+            addState(pattern, next, i);
+            break;
+        }
+    }
+    return findState(pattern, next);
+}
+
+/* ------------------------------------------------------------------------- */
+
+usbPattern *usbPatternCompile(const char *patterns)
+{
+    usbPattern *pattern = calloc(1, sizeof(*pattern));
+    size_t len = strlen(patterns);
+    const char *p, *end;
+    int numClasses = 0, patternStart = 0, i;
+
+    if(pattern == NULL)
+        return NULL;
+    pattern->items = malloc((len + 1) * sizeof(*pattern->items));
+    pattern->classes = malloc((len / 2 + 1) * sizeof(*pattern->classes));
+    if(pattern->items == NULL || pattern->classes == NULL){
+        usbPatternFree(pattern);
+        return NULL;
+    }
+    for(p = patterns; ; p++){
+        switch(*p){
+        case 0:
+        case ',':
+            addItem(pattern, ITEM_ACCEPT, 0, 0);
+            patternStart = pattern->numItems;
+            break;
+        case '\\':
+            if(p[1] != 0)
+                p++;
+            addItem(pattern, ITEM_LITERAL, (unsigned char)*p, 0);
+            break;
+        case '?':
+            addItem(pattern, ITEM_ANY, 0, 0);
+            break;
+        case '*':
+            /* consecutive stars act just like one */
+            if(pattern->numItems == patternStart
+               || pattern->items[pattern->numItems - 1].type != ITEM_STAR)
+                addItem(pattern, ITEM_STAR, 0, 0);
+            break;
+        case '[':
+            if((end = classEnd(p + 1)) != NULL){
+                parseClass(pattern->classes[numClasses], p + 1, end);
+                addItem(pattern, ITEM_CLASS, 0, numClasses++);
+                p = end;
+                break;
+            }
+            /* FALLTHROUGH: a '[' without ']' is literal */
+        default:
+            addItem(pattern, ITEM_LITERAL, (unsigned char)*p, 0);
+        }
+        if(*p == 0)
+            break;
+    }
+
+    pattern->words = (pattern->numItems + WORD_BITS - 1) / WORD_BITS;
+    pattern->startSet = calloc(pattern->words, sizeof(unsigned long));
+    pattern->scratch = calloc(pattern->words, sizeof(unsigned long));
+    pattern->states = malloc(DFA_MAX_STATES * sizeof(*pattern->states));
+    pattern->sets = malloc(DFA_MAX_STATES * pattern->words * sizeof(unsigned long));
+    if(pattern->startSet == NULL || pattern->scratch == NULL
+       || pattern->states == NULL || pattern->sets == NULL){
+        usbPatternFree(pattern);
+        return NULL;
+    }
+    /* every pattern starts right after the previous ACCEPT */
+    addState(pattern, pattern->startSet, 0);
+    for(i = 0; i < pattern->numItems - 1; i++){
+        if(pattern->items[i].type == ITEM_ACCEPT)
+            addState(pattern, pattern->startSet, i + 1);
+    }
+    flushStates(pattern);
+    findState(pattern, pattern->startSet);
+    return pattern;
+}
+
+int usbPatternMatch(usbPattern *pattern, const char *text)
+{
+    const unsigned char *t = (const unsigned char *)text;
+    int s = 0, next;
+
+    if(pattern == NULL)
+        return 1;
+    for(; *t && !pattern->states[s].dead; t++){
+        if((next = pattern->states[s].next[*t]) < 0){
+            int generation = pattern->generation;
+
+            next = step(pattern, s, *t);
+            if(pattern->generation == generation)   /* 's' is still valid */
+                pattern->states[s].next[*t] = next;
+        }
+        s = next;
+    }
+    return *t == 0 && pattern->states[s].accepting;
+}
+
+void usbPatternFree(usbPattern *pattern)
+{
+    if(pattern == NULL)
+        return;
+    free(pattern->items);
+    free(pattern->classes);
+    free(pattern->startSet);
+    free(pattern->scratch);
+    free(pattern->states);
+    free(pattern->sets);
+    free(pattern);
+}
@@ -0,0 +1,46 @@
+/* Name: pattern.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module matches strings against sets of Unix shell style patterns.
+A comma separated list of patterns is compiled once into a single
+automaton: each pattern position is an NFA state and the sets of states
+reached are turned into DFA states lazily while matching, so a string is
+matched against all patterns of the set in one pass, in time linear in its
+length. The DFA states are kept between calls up to a fixed limit, hence
+matching many strings against the same set mostly only follows cached
+transitions.
+*/
+
+#ifndef __PATTERN_H_INCLUDED__
+#define __PATTERN_H_INCLUDED__
+
+typedef struct usbPattern usbPattern;
+
+usbPattern *usbPatternCompile(const char *patterns);
+/* This function compiles a comma separated list of patterns. '*' stands for
+ * 0 or more characters, '?' for one single character, a list of characters
+ * in square brackets for a single character from the list (dashes are
+ * allowed to specify a range) and if the list of characters begins with a
+ * caret ('^'), it matches one character which is NOT in the list. A
+ * backslash makes the following character match literally, which is also
+ * the way to put a comma into a pattern outside of square brackets.
+ * Returns: the compiled pattern set or NULL if memory is exhausted.
+ */
+
+int usbPatternMatch(usbPattern *pattern, const char *text);
+/* Returns: 1 if 'text' matches at least one pattern of the set, 0
+ * otherwise. A NULL 'pattern' matches any text.
+ */
+
+void usbPatternFree(usbPattern *pattern);
+/* Frees a pattern set returned by usbPatternCompile(). */
+
+#endif /* __PATTERN_H_INCLUDED__ */
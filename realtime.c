@@ -0,0 +1,97 @@
+/* Name: realtime.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+CPU pinning, real-time scheduling and memory locking of the event thread.
+See realtime.h for the interface.
+*/
+
+#define _GNU_SOURCE /* CPU_SET, pthread_setaffinity_np */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#include "realtime.h"
+
+#define PREFAULT_STACK  (256 * 1024)    /* bytes of stack touched in advance */
+
+#ifndef _WIN32
+/* touches the stack pages the event handling may need, they stay locked */
+static void prefaultStack(void)
+{
+    unsigned char stack[PREFAULT_STACK];
+
+    memset(stack, 0, sizeof(stack));
+    __asm__ __volatile__("" : : "r"(stack) : "memory");  /* keep the memset */
+}
+#endif
+
+int realtimeEnter(int cpu, int priority, int lockMemory, FILE *warningsFp)
+{
+    int result = 0;
+
+    if(cpu >= 0){
+#ifdef __linux__
+        cpu_set_t set;
+        int r;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if((r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0){
+            if(warningsFp != NULL)
+                fprintf(warningsFp, "Warning: could not pin the event thread to CPU %d: %s\n", cpu, strerror(r));
+            result |= REALTIME_CPU;
+        }
+#else
+        if(warningsFp != NULL)
+            fprintf(warningsFp, "Warning: CPU pinning is not supported on this system\n");
+        result |= REALTIME_CPU;
+#endif
+    }
+    if(priority > 0){
+#ifndef _WIN32
+        struct sched_param param;
+        int r;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if((r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0){
+            if(warningsFp != NULL)
+                fprintf(warningsFp, "Warning: could not set SCHED_FIFO priority %d: %s\n", priority, strerror(r));
+            result |= REALTIME_PRIORITY;
+        }
+#else
+        if(warningsFp != NULL)
+            fprintf(warningsFp, "Warning: real-time scheduling is not supported on this system\n");
+        result |= REALTIME_PRIORITY;
+#endif
+    }
+    if(lockMemory){
+#ifndef _WIN32
+        if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+            if(warningsFp != NULL)
+                fprintf(warningsFp, "Warning: could not lock memory: %s\n", strerror(errno));
+            result |= REALTIME_LOCK;
+        }else{
+            prefaultStack();
+        }
+#else
+        if(warningsFp != NULL)
+            fprintf(warningsFp, "Warning: memory locking is not supported on this system\n");
+        result |= REALTIME_LOCK;
+#endif
+    }
+    return result;
+}
@@ -0,0 +1,41 @@
+/* Name: realtime.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module prepares the thread handling the libusb events for low latency
+transfers: it pins the thread to one CPU, switches it to the SCHED_FIFO
+real-time policy and locks the memory of the process so that neither
+migrations, other tasks nor page faults delay the completion of a transfer.
+Pinning is supported on Linux only, the rest on POSIX systems.
+*/
+
+#ifndef __REALTIME_H_INCLUDED__
+#define __REALTIME_H_INCLUDED__
+
+#include <stdio.h>
+
+#define REALTIME_CPU        1   /* pinning to the CPU */
+#define REALTIME_PRIORITY   2   /* the SCHED_FIFO policy */
+#define REALTIME_LOCK       4   /* memory locking */
+
+int realtimeEnter(int cpu, int priority, int lockMemory, FILE *warningsFp);
+/* Applies the settings to the calling thread. If 'cpu' is not negative, the
+ * thread is pinned to this CPU. If 'priority' is greater than 0, the thread
+ * is scheduled with SCHED_FIFO at this priority (1 to 99). If 'lockMemory'
+ * is non-zero, all current and future memory of the process is locked and
+ * the stack of the calling thread is prefaulted. Threads created later
+ * inherit the CPU and the policy, so this should be called after all other
+ * threads have been started. Settings which can't be applied are reported
+ * to 'warningsFp' if it is not NULL.
+ * Returns: 0 if all settings were applied or the REALTIME_* bits of those
+ * which were not.
+ */
+
+#endif /* __REALTIME_H_INCLUDED__ */
@@ -0,0 +1,649 @@
+/* Name: sink.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Output sink writing received buffers on a separate thread without copying.
+See sink.h for the interface.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "sink.h"
+#include "stats.h"
+#include "trace.h"
+
+#define SINK_BATCH          64  /* buffers written at once */
+#define SINK_RING_DEPTH     8   /* io_uring writes in flight */
+#define SINK_GAPS           16  /* room for gap markers in the queue besides one per buffer */
+#define SINK_DRAIN_MS       2000    /* longest wait for the pipe reader at the end */
+
+#ifdef _WIN32
+struct iovec {
+    void    *iov_base;
+    size_t  iov_len;
+};
+
+static ssize_t  writev(int fd, const struct iovec *iov, int n)
+{
+    return write(fd, iov->iov_base, iov->iov_len);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+struct sinkEntry {
+    unsigned char   *buffer;
+    int             len;
+    long            seq;
+    long long       end;    /* pipe offset after the data, for vmsplice() */
+    long long       ns;     /* completion time */
+    int             flags;  /* SINK_* */
+};
+
+/* Single-producer single-consumer ring, 'size' is a power of two. */
+struct sinkQueue {
+    struct sinkEntry    *entries;
+    unsigned            mask;
+    unsigned            head;   /* written by the consumer only */
+    unsigned            tail;   /* written by the producer only */
+};
+
+static int  queueInit(struct sinkQueue *q, int size)
+{
+    unsigned n = 1;
+
+    while(n < size)
+        n <<= 1;
+    if((q->entries = calloc(n, sizeof(q->entries[0]))) == NULL)
+        return -1;
+    q->mask = n - 1;
+    q->head = q->tail = 0;
+    return 0;
+}
+
+static int  queuePush(struct sinkQueue *q, const struct sinkEntry *e)
+{
+    unsigned tail = q->tail;
+
+    if(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask)
+        return -1;
+    q->entries[tail & q->mask] = *e;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int  queuePop(struct sinkQueue *q, struct sinkEntry *e)
+{
+    unsigned head = q->head;
+
+    if(head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+        return -1;
+    *e = q->entries[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int  queueEmpty(struct sinkQueue *q)
+{
+    return q->head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static struct sinkQueue filledQueue;    /* event thread -> writer */
+static struct sinkQueue freeQueue;      /* writer -> event thread */
+static struct sinkQueue heldQueue;      /* writer only: vmspliced, maybe unread */
+static unsigned char    *pool = NULL;
+static int              sinkFd;
+static usbSinkWriter    sinkWriter;
+static void             *sinkContext;
+static struct sinkEntry *writing;       /* entry passed to the writer function */
+static int              sinkFailed;
+static int              sinkErrno;
+static int              closing;
+static int              poolHeld;       /* still referenced by an unread pipe, don't free */
+static int              writerSleeping;
+static pthread_t        writerThread;
+static pthread_mutex_t  sinkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   sinkWakeup = PTHREAD_COND_INITIALIZER;
+static long long        fileOffset;     /* bytes written to a file */
+static long long        spliceTotal;    /* bytes written to a pipe */
+static int              usePipe;
+static int              directIo;
+#ifdef HAVE_LIBURING
+struct ringBatch {
+    struct sinkEntry    entries[SINK_BATCH];
+    struct iovec        iov[SINK_BATCH];
+    int                 n;
+    size_t              total;
+    long long           offset;
+    int                 busy;
+};
+
+static struct io_uring  ring;
+static struct ringBatch ringBatches[SINK_RING_DEPTH];
+static int              ringInFlight;
+static int              useRing;
+
+static void ringWait(int max);
+#endif
+
+static void release(struct sinkEntry *e)
+{
+    queuePush(&freeQueue, e);   /* never full: holds all buffers */
+}
+
+static void fail(int err)
+{
+    if(!sinkFailed){
+        sinkErrno = err;
+        __atomic_store_n(&sinkFailed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* advances the vector by 'len' bytes, returns the number of entries left */
+static int  advance(struct iovec **iov, int n, size_t len)
+{
+    while(n > 0 && len >= (*iov)->iov_len){
+        len -= (*iov)->iov_len;
+        (*iov)++;
+        n--;
+    }
+    if(n > 0){
+        (*iov)->iov_base = (char *)(*iov)->iov_base + len;
+        (*iov)->iov_len -= len;
+    }
+    return n;
+}
+
+static int  writeAll(struct iovec *iov, int n)
+{
+    ssize_t r;
+
+    while(n > 0){
+        if((r = writev(sinkFd, iov, n)) < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        fileOffset += r;
+        n = advance(&iov, n, r);
+    }
+    return 0;
+}
+
+/* O_DIRECT needs block aligned lengths and offsets; the buffers are aligned */
+static void checkDirect(struct iovec *iov, int n)
+{
+#ifdef O_DIRECT
+    long long offset = fileOffset;
+    int i;
+
+    if(!directIo)
+        return;
+    for(i = 0; i < n; i++){
+        if(offset % SINK_ALIGNMENT != 0)
+            break;
+        offset += iov[i].iov_len;
+    }
+    if(i == n && offset % SINK_ALIGNMENT == 0)
+        return;
+#ifdef HAVE_LIBURING
+    if(useRing)
+        ringWait(0);
+#endif
+    fcntl(sinkFd, F_SETFL, fcntl(sinkFd, F_GETFL) & ~O_DIRECT);
+    directIo = 0;
+    fprintf(stderr, "Warning: received data is not block aligned, O_DIRECT turned off.\n");
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+#ifdef __linux__
+/* Pages given to vmsplice() are referenced by the pipe until they are read,
+ * so a buffer is only reused after the reader has consumed it.
+ */
+static void releaseConsumed(void)
+{
+    struct sinkEntry e;
+    int unread;
+
+    if(ioctl(sinkFd, FIONREAD, &unread) < 0)
+        return;
+    while(!queueEmpty(&heldQueue)
+          && heldQueue.entries[heldQueue.head & heldQueue.mask].end <= spliceTotal - unread){
+        queuePop(&heldQueue, &e);
+        release(&e);
+    }
+}
+
+static int  spliceAll(struct sinkEntry *batch, struct iovec *iov, int n)
+{
+    int i, left = n;
+    ssize_t r;
+
+    while(left > 0){
+        if((r = vmsplice(sinkFd, iov, left, 0)) < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        spliceTotal += r;
+        left = advance(&iov, left, r);
+    }
+    for(i = 0; i < n; i++)
+        queuePush(&heldQueue, &batch[i]);
+    releaseConsumed();
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LIBURING
+static void ringComplete(struct io_uring_cqe *cqe)
+{
+    struct ringBatch *b = io_uring_cqe_get_data(cqe);
+    int i, res = cqe->res;
+
+    io_uring_cqe_seen(&ring, cqe);
+    if(res < 0){
+        fail(-res);
+    }else if(res < b->total){   /* short write, finish it synchronously */
+        struct iovec *iov = b->iov;
+        long long offset = b->offset + res;
+        int n = advance(&iov, b->n, res);
+        ssize_t r;
+
+        while(n > 0){
+            if((r = pwritev(sinkFd, iov, n, offset)) < 0){
+                if(errno == EINTR)
+                    continue;
+                fail(errno);
+                break;
+            }
+            offset += r;
+            n = advance(&iov, n, r);
+        }
+    }
+    traceEvent(TRACE_WRITE_COMPLETE, b->entries[0].seq);
+    for(i = 0; i < b->n; i++)
+        release(&b->entries[i]);
+    b->busy = 0;
+    ringInFlight--;
+}
+
+static void ringWait(int max)
+{
+    struct io_uring_cqe *cqe;
+
+    while(ringInFlight > max){
+        if(io_uring_wait_cqe(&ring, &cqe) < 0)
+            break;
+        ringComplete(cqe);
+    }
+}
+
+static void ringWrite(struct sinkEntry *batch, int n)
+{
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    struct ringBatch *b;
+    int i;
+
+    ringWait(SINK_RING_DEPTH - 1);
+    for(b = ringBatches; b->busy; b++)
+        continue;
+    b->n = n;
+    b->total = 0;
+    for(i = 0; i < n; i++){
+        b->entries[i] = batch[i];
+        b->iov[i].iov_base = batch[i].buffer;
+        b->iov[i].iov_len = batch[i].len;
+        b->total += batch[i].len;
+    }
+    checkDirect(b->iov, n);
+    b->offset = fileOffset;
+    fileOffset += b->total;
+    sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_writev(sqe, sinkFd, b->iov, n, b->offset);
+    io_uring_sqe_set_data(sqe, b);
+    traceEvent(TRACE_WRITE_SUBMIT, batch[0].seq);
+    b->busy = 1;
+    ringInFlight++;
+    io_uring_submit(&ring);
+    while(io_uring_peek_cqe(&ring, &cqe) == 0)
+        ringComplete(cqe);
+}
+#endif
+
+static void writeBatch(struct sinkEntry *batch, int n)
+{
+    struct iovec iov[SINK_BATCH];
+    long long end = spliceTotal;
+    int i;
+
+    if(sinkFailed){
+        for(i = 0; i < n; i++)
+            release(&batch[i]);
+        return;
+    }
+#ifdef HAVE_LIBURING
+    if(useRing){    /* traced from submission to completion */
+        ringWrite(batch, n);
+        return;
+    }
+#endif
+    traceEvent(TRACE_WRITE_BEGIN, batch[0].seq);
+    for(i = 0; i < n; i++){
+        iov[i].iov_base = batch[i].buffer;
+        iov[i].iov_len = batch[i].len;
+        end += batch[i].len;
+        batch[i].end = end;
+    }
+#ifdef __linux__
+    if(usePipe){
+        if(spliceAll(batch, iov, n) == 0){
+            traceEvent(TRACE_WRITE_END, batch[0].seq);
+            return;
+        }
+        if((errno == EINVAL || errno == ENOSYS) && spliceTotal == 0){
+            usePipe = 0;    /* not supported, fall back to writev() */
+            writeBatch(batch, n);
+            return;
+        }
+        fail(errno);
+    }else
+#endif
+    {
+        checkDirect(iov, n);
+        if(writeAll(iov, n) != 0)
+            fail(errno);
+    }
+    for(i = 0; i < n; i++)
+        release(&batch[i]);
+    traceEvent(TRACE_WRITE_END, batch[0].seq);
+}
+
+/* waits for filled buffers, returns 0 when the sink is closed and drained */
+static int  takeBatch(struct sinkEntry *batch, int max)
+{
+    struct timespec deadline;
+    int n = 0;
+
+    for(;;){
+        /* read 'closing' first: buffers queued before it was set are
+         * found by the following pops
+         */
+        int closed = __atomic_load_n(&closing, __ATOMIC_ACQUIRE);
+
+        while(n < max && queuePop(&filledQueue, &batch[n]) == 0)
+            n++;
+        if(n > 0 || closed)
+            return n;
+        pthread_mutex_lock(&sinkLock);
+        __atomic_store_n(&writerSleeping, 1, __ATOMIC_SEQ_CST);
+        if(queueEmpty(&filledQueue) && !__atomic_load_n(&closing, __ATOMIC_ACQUIRE)){
+            if(!queueEmpty(&heldQueue)){    /* poll the pipe for consumed buffers */
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                if((deadline.tv_nsec += 1000000L) >= 1000000000L){
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&sinkWakeup, &sinkLock, &deadline);
+            }else{
+                pthread_cond_wait(&sinkWakeup, &sinkLock);
+            }
+        }
+        __atomic_store_n(&writerSleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&sinkLock);
+#ifdef __linux__
+        if(usePipe)
+            releaseConsumed();
+#endif
+    }
+}
+
+static void *sinkThread(void *arg)
+{
+    struct sinkEntry batch[SINK_BATCH];
+    int i, j, n;
+#ifdef __linux__
+    long long deadline;
+#endif
+
+    traceThreadInit("output sink");
+    while((n = takeBatch(batch, SINK_BATCH)) > 0){
+        if(sinkWriter != NULL){
+            for(i = 0; i < n; i++){
+                writing = &batch[i];
+                errno = 0;
+                if(!sinkFailed && sinkWriter(sinkContext, batch[i].seq, batch[i].buffer, batch[i].len) != 0)
+                    fail(errno != 0 ? errno : EIO);     /* stops the stream at the next sinkPut() */
+                if(batch[i].buffer != NULL)     /* not a gap marker */
+                    release(&batch[i]);
+            }
+        }else{
+            for(i = j = 0; i < n; i++){         /* drop gap markers */
+                if(batch[i].buffer != NULL)
+                    batch[j++] = batch[i];
+            }
+            if(j > 0)
+                writeBatch(batch, j);
+        }
+    }
+#ifdef HAVE_LIBURING
+    if(useRing){
+        ringWait(0);
+        io_uring_queue_exit(&ring);
+    }
+#endif
+#ifdef __linux__
+    /* The pool may only be freed after the reader has consumed the pages
+     * given to vmsplice(), but a reader which stops reading must not hold up
+     * the exit: after a while the pool is left allocated.
+     */
+    deadline = statsClockNs() + SINK_DRAIN_MS * 1000000LL;
+    while(usePipe && !sinkFailed && !queueEmpty(&heldQueue)){
+        struct pollfd pfd = { sinkFd, 0, 0 };
+
+        if(poll(&pfd, 1, 1) > 0 && (pfd.revents & (POLLERR | POLLHUP)))
+            break;      /* the reader is gone, nobody will see the pages */
+        releaseConsumed();
+        if(!queueEmpty(&heldQueue) && statsClockNs() >= deadline){
+            fprintf(stderr, "Warning: the output pipe is not being read, leaving the unread data to it.\n");
+            poolHeld = 1;
+            break;
+        }
+    }
+#endif
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int sinkStart(int fd, usbSinkWriter writer, void *context,
+              int bufferSize, int numBuffers, int reserved)
+{
+    struct sinkEntry e;
+    size_t stride = (bufferSize + SINK_ALIGNMENT - 1) / SINK_ALIGNMENT * SINK_ALIGNMENT;
+    int i, err;
+
+    if(stride == 0)
+        stride = SINK_ALIGNMENT;
+    if(numBuffers <= reserved)
+        numBuffers = reserved + 1;
+#ifdef HAVE_LIBURING
+    useRing = 0;
+#endif
+#ifdef _WIN32
+    if((pool = _aligned_malloc(stride * numBuffers, SINK_ALIGNMENT)) == NULL)
+        return -1;
+#else
+    if((err = posix_memalign((void **)&pool, SINK_ALIGNMENT, stride * numBuffers)) != 0){
+        pool = NULL;
+        errno = err;
+        return -1;
+    }
+#endif
+    memset(pool, 0, stride * numBuffers);   /* fault the pages in now */
+    filledQueue.entries = freeQueue.entries = heldQueue.entries = NULL;
+    if(queueInit(&filledQueue, 2 * numBuffers + SINK_GAPS) != 0 || queueInit(&freeQueue, numBuffers) != 0
+       || queueInit(&heldQueue, numBuffers) != 0)
+        goto error;
+    memset(&e, 0, sizeof(e));
+    for(i = 0; i < numBuffers; i++){
+        e.buffer = pool + i * stride;
+        release(&e);
+    }
+    sinkFd = fd;
+    sinkWriter = writer;
+    sinkContext = context;
+    sinkFailed = 0;
+    closing = 0;
+    poolHeld = 0;
+    fileOffset = 0;
+    spliceTotal = 0;
+    usePipe = 0;
+    directIo = 0;
+    if(writer == NULL){
+        struct stat st;
+
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+            if((fileOffset = lseek(fd, 0, SEEK_CUR)) < 0)
+                fileOffset = 0;
+#ifdef O_DIRECT
+            directIo = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+#endif
+#ifdef HAVE_LIBURING
+            useRing = !(fcntl(fd, F_GETFL) & O_APPEND)
+                      && io_uring_queue_init(SINK_RING_DEPTH, &ring, 0) == 0;
+            ringInFlight = 0;
+            memset(ringBatches, 0, sizeof(ringBatches));
+#endif
+        }
+#ifdef __linux__
+        else if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)){
+            usePipe = 1;
+        }
+#endif
+    }
+    if((err = pthread_create(&writerThread, NULL, sinkThread, NULL)) != 0){
+        errno = err;
+        goto error;
+    }
+    return 0;
+
+error:
+    err = errno;
+#ifdef HAVE_LIBURING
+    if(useRing)
+        io_uring_queue_exit(&ring);
+#endif
+    free(heldQueue.entries);
+    free(freeQueue.entries);
+    free(filledQueue.entries);
+#ifdef _WIN32
+    _aligned_free(pool);
+#else
+    free(pool);
+#endif
+    pool = NULL;
+    errno = err;
+    return -1;
+}
+
+unsigned char *sinkGetBuffer(void)
+{
+    struct sinkEntry e;
+
+    if(queuePop(&freeQueue, &e) != 0)
+        return NULL;
+    return e.buffer;
+}
+
+int sinkPut(long seq, unsigned char *buffer, int len, int flags)
+{
+    struct sinkEntry e;
+
+    if(__atomic_load_n(&sinkFailed, __ATOMIC_RELAXED))
+        return -1;
+    e.buffer = buffer;
+    e.len = len;
+    e.seq = seq;
+    e.end = 0;
+    e.ns = statsClockNs();
+    e.flags = flags;
+    if(queuePush(&filledQueue, &e) != 0)   /* only gap markers can fill it */
+        return -1;
+    if(__atomic_load_n(&writerSleeping, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&sinkLock);
+        pthread_cond_signal(&sinkWakeup);
+        pthread_mutex_unlock(&sinkLock);
+    }
+    return 0;
+}
+
+int sinkPutGap(long seq)
+{
+    return sinkPut(seq, NULL, 0, 0);
+}
+
+long long sinkEntryTime(int *flags)
+{
+    if(flags != NULL)
+        *flags = writing->flags;
+    return writing->ns;
+}
+
+int sinkStop(void)
+{
+    if(pool == NULL)
+        return 0;
+    pthread_mutex_lock(&sinkLock);
+    __atomic_store_n(&closing, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&sinkWakeup);
+    pthread_mutex_unlock(&sinkLock);
+    pthread_join(writerThread, NULL);
+#ifdef _WIN32
+    _aligned_free(pool);
+#else
+    if(!poolHeld)   /* otherwise leaked, the pipe still refers to it */
+        free(pool);
+#endif
+    pool = NULL;
+    free(filledQueue.entries);
+    free(freeQueue.entries);
+    free(heldQueue.entries);
+    if(sinkFailed){
+        errno = sinkErrno;
+        return -1;
+    }
+    return 0;
+}
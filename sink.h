@@ -0,0 +1,84 @@
+/* Name: sink.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module writes received data on a separate thread so that a slow disk or
+a full pipe doesn't hold up the USB transfers. The sink owns a fixed pool of
+transfer buffers. The thread handling the libusb events takes an empty buffer
+from the pool for each transfer and passes the filled buffer to the writer
+thread through a lock-free single-producer single-consumer queue; the writer
+returns written buffers through a second queue. The data is never copied:
+files are written with io_uring (if compiled with HAVE_LIBURING) or writev(),
+honoring O_DIRECT while the data stays aligned, and pipes are fed with
+vmsplice() on Linux.
+*/
+
+#ifndef __SINK_H_INCLUDED__
+#define __SINK_H_INCLUDED__
+
+typedef int (*usbSinkWriter)(void *context, long seq, unsigned char *data, int len);
+/* Formats and writes one buffer on the writer thread. Same signature as
+ * usbStreamHandler. Returns 0 on success or non-zero on a write error (with
+ * errno set), which fails the sink like an error writing raw data: the
+ * following buffers are dropped, sinkPut() returns -1 and sinkStop()
+ * reports the error.
+ */
+
+#define SINK_ALIGNMENT      4096    /* buffer alignment, enough for O_DIRECT */
+
+int sinkStart(int fd, usbSinkWriter writer, void *context,
+              int bufferSize, int numBuffers, int reserved);
+/* This function allocates 'numBuffers' buffers of 'bufferSize' bytes and
+ * starts the writer thread. If 'writer' is NULL, the data is written to the
+ * file descriptor 'fd' as is, otherwise 'writer' is called for each buffer
+ * on the writer thread. 'reserved' is the number of buffers the caller keeps
+ * at a time (e. g. in flight transfers); the pool is enlarged if necessary
+ * to leave at least one more buffer for the writer.
+ * Returns: 0 on success or -1 on error (errno is set).
+ */
+
+unsigned char *sinkGetBuffer(void);
+/* Takes an empty buffer from the pool. Must be called from a single thread
+ * (the one calling sinkPut()).
+ * Returns: the buffer or NULL if all buffers are in use.
+ */
+
+#define SINK_PARTIAL        1       /* transfer ended early, not at a short packet */
+
+int sinkPut(long seq, unsigned char *buffer, int len, int flags);
+/* Queues a buffer obtained from sinkGetBuffer() holding 'len' bytes of data
+ * for writing. 'seq' is the transfer sequence number used for tracing,
+ * 'flags' is a combination of SINK_* flags for the writer. The time of the
+ * call is recorded as the completion time of the data.
+ * Returns: 0 on success or -1 if the sink has failed to write.
+ */
+
+int sinkPutGap(long seq);
+/* Queues a gap marker in front of the data of transfer 'seq': the writer is
+ * called with 'data' NULL and 'len' 0, raw output skips it. There is room
+ * for one marker in front of each buffer and a few more.
+ * Returns: 0 on success or -1 if the sink has failed to write or the marker
+ * doesn't fit into the queue.
+ */
+
+long long sinkEntryTime(int *flags);
+/* May only be called from the writer function. Stores the flags of the
+ * buffer being written in 'flags' if it is not NULL.
+ * Returns: the completion time of the buffer being written (see
+ * statsClockNs() in stats.h).
+ */
+
+int sinkStop(void);
+/* Writes out all queued buffers, stops the writer thread and frees the
+ * buffer pool. Buffers obtained from sinkGetBuffer() become invalid.
+ * Returns: 0 on success or -1 if writing has failed (errno is set).
+ */
+
+#endif /* __SINK_H_INCLUDED__ */
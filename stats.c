@@ -0,0 +1,367 @@
+/* Name: stats.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Transfer counters and the periodic statistics reporter thread.
+See stats.h for the interface.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+static usbStats         *statsCurrent = NULL;
+static usbStats         statsPrevious;
+static long long        statsPreviousNs;
+static int              statsIntervalMs;
+static const char       *statsFileName;
+static FILE             *statsOut;
+static int              statsStopping;
+static pthread_t        statsThread;
+static pthread_mutex_t  statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   statsWakeup = PTHREAD_COND_INITIALIZER;
+
+long long statsClockNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Log-linear histogram: values below 2^STATS_SUB_BITS have a bucket each,
+ * every following power of two is split into 2^STATS_SUB_BITS buckets.
+ */
+static int  latencyBucket(unsigned long long v)
+{
+    int e;
+
+    if(v < (1 << STATS_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+           + ((v >> (e - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+/* returns the largest value counted in the bucket */
+static unsigned long long   bucketValue(int bucket)
+{
+    int e, sub;
+
+    if(bucket < (1 << STATS_SUB_BITS))
+        return bucket;
+    e = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+    return (1ULL << e) + ((unsigned long long)(sub + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+void statsAddLatency(usbStats *stats, long long ns)
+{
+    unsigned long long us = ns < 0 ? 0 : ns / 1000;
+
+    STATS_ADD(stats->latency[latencyBucket(us)], 1);
+    if(us > stats->latencyMax)
+        STATS_ADD(stats->latencyMax, us - stats->latencyMax);
+}
+
+void statsAddInterval(usbStats *stats, long long ns)
+{
+    unsigned long long us = ns < 0 ? 0 : ns / 1000;
+
+    STATS_ADD(stats->interval[latencyBucket(us)], 1);
+    if(us > stats->intervalMax)
+        STATS_ADD(stats->intervalMax, us - stats->intervalMax);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NUM_QUANTILES   (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static void snapshot(usbStats *snap)
+{
+    int i;
+
+    snap->bytes = STATS_GET(statsCurrent->bytes);
+    snap->transfers = STATS_GET(statsCurrent->transfers);
+    snap->errors = STATS_GET(statsCurrent->errors);
+    snap->timeouts = STATS_GET(statsCurrent->timeouts);
+    snap->stalls = STATS_GET(statsCurrent->stalls);
+    snap->overruns = STATS_GET(statsCurrent->overruns);
+    snap->lost = STATS_GET(statsCurrent->lost);
+    snap->recoveries = STATS_GET(statsCurrent->recoveries);
+    snap->reconnects = STATS_GET(statsCurrent->reconnects);
+    snap->recoveryNs = STATS_GET(statsCurrent->recoveryNs);
+    snap->inFlight = STATS_GET(statsCurrent->inFlight);
+    snap->compressIn = STATS_GET(statsCurrent->compressIn);
+    snap->compressOut = STATS_GET(statsCurrent->compressOut);
+    snap->compressWaitNs = STATS_GET(statsCurrent->compressWaitNs);
+    for(i = 0; i < STATS_BUCKETS; i++)
+        snap->latency[i] = STATS_GET(statsCurrent->latency[i]);
+    snap->latencyMax = STATS_GET(statsCurrent->latencyMax);
+    snap->messages = STATS_GET(statsCurrent->messages);
+    snap->messagesDropped = STATS_GET(statsCurrent->messagesDropped);
+}
+
+/* computes the latency quantiles (in microseconds) of the interval */
+static unsigned long long   intervalQuantiles(usbStats *snap, unsigned long long *values)
+{
+    unsigned long long total = 0, sum = 0;
+    int i, q = 0;
+
+    for(i = 0; i < STATS_BUCKETS; i++)
+        total += snap->latency[i] - statsPrevious.latency[i];
+    for(i = 0; i < STATS_BUCKETS && q < NUM_QUANTILES; i++){
+        sum += snap->latency[i] - statsPrevious.latency[i];
+        while(q < NUM_QUANTILES && total > 0 && sum >= quantiles[q] * total)
+            values[q++] = bucketValue(i);
+    }
+    return total;
+}
+
+/* Prints the quantiles and the histogram of 'hist' with one line per power
+ * of two. The total is printed into 'title'. With 'rates', each line also
+ * shows the range of rates corresponding to its intervals.
+ */
+static void printHistogram(FILE *out, const char *title, unsigned long long *hist,
+                           unsigned long long max, int rates)
+{
+    static const double finalQuantiles[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    unsigned long long total = 0, sum = 0, row = 0, value, low;
+    int i, q = 0, numQuantiles = sizeof(finalQuantiles) / sizeof(finalQuantiles[0]);
+
+    for(i = 0; i < STATS_BUCKETS; i++)
+        total += hist[i];
+    if(total == 0)
+        return;
+    fprintf(out, title, total);
+    for(i = 0; i < STATS_BUCKETS && q < numQuantiles; i++){
+        sum += hist[i];
+        while(q < numQuantiles && sum >= finalQuantiles[q] * total){
+            value = bucketValue(i);     /* the bucket's upper bound, the maximum is exact */
+            fprintf(out, " p%g %llu us,", finalQuantiles[q++] * 100, value < max ? value : max);
+        }
+    }
+    fprintf(out, " max %llu us\n", max);
+    /* one line per power of two, i.e. per 1 << STATS_SUB_BITS buckets */
+    sum = 0;
+    for(i = 0; i < STATS_BUCKETS; i++){
+        row += hist[i];
+        if(((i + 1) & ((1 << STATS_SUB_BITS) - 1)) != 0 && i >= (1 << STATS_SUB_BITS))
+            continue;
+        if(row > 0){
+            sum += row;
+            low = i < (1 << STATS_SUB_BITS) ? i : bucketValue(i - (1 << STATS_SUB_BITS)) + 1;
+            fprintf(out, "  %10llu - %10llu us", low, bucketValue(i));
+            if(rates)
+                fprintf(out, " (%10.1f - %10.1f/s)", 1e6 / (bucketValue(i) + 1), low > 0 ? 1e6 / low : 1e6);
+            fprintf(out, ": %12llu %7.3f%% %8.4f%%\n", row, row * 100.0 / total, sum * 100.0 / total);
+        }
+        row = 0;
+    }
+}
+
+void statsPrintLatency(usbStats *stats, FILE *out)
+{
+    printHistogram(out, "Latency of %llu transfers (submit to completion):",
+                   stats->latency, stats->latencyMax, 0);
+}
+
+void statsPrintMessages(usbStats *stats, FILE *out)
+{
+    fprintf(out, "%llu messages received, %llu incomplete ones dropped.\n",
+            stats->messages, stats->messagesDropped);
+    printHistogram(out, "Intervals between %llu messages:", stats->interval, stats->intervalMax, 1);
+}
+
+static void writePrometheus(usbStats *snap, double bytesPerSec, double transfersPerSec,
+                            double messagesPerSec, unsigned long long *values, unsigned long long samples)
+{
+    char tmpName[4096];
+    FILE *fp;
+    int q;
+
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", statsFileName);
+    if((fp = fopen(tmpName, "w")) == NULL){
+        fprintf(stderr, "Error writing \"%s\": %s\n", tmpName, strerror(errno));
+        return;
+    }
+    fprintf(fp, "# HELP usbtool_bytes_total Bytes transferred.\n"
+                "# TYPE usbtool_bytes_total counter\n"
+                "usbtool_bytes_total %llu\n", snap->bytes);
+    fprintf(fp, "# HELP usbtool_transfers_total Completed transfers.\n"
+                "# TYPE usbtool_transfers_total counter\n"
+                "usbtool_transfers_total %llu\n", snap->transfers);
+    fprintf(fp, "# HELP usbtool_errors_total Failed transfers.\n"
+                "# TYPE usbtool_errors_total counter\n"
+                "usbtool_errors_total %llu\n", snap->errors);
+    fprintf(fp, "# HELP usbtool_timeouts_total Timed out transfers.\n"
+                "# TYPE usbtool_timeouts_total counter\n"
+                "usbtool_timeouts_total %llu\n", snap->timeouts);
+    fprintf(fp, "# HELP usbtool_stalls_total Stalled transfers.\n"
+                "# TYPE usbtool_stalls_total counter\n"
+                "usbtool_stalls_total %llu\n", snap->stalls);
+    fprintf(fp, "# HELP usbtool_overruns_total Received transfers dropped for lack of output buffers.\n"
+                "# TYPE usbtool_overruns_total counter\n"
+                "usbtool_overruns_total %llu\n", snap->overruns);
+    fprintf(fp, "# HELP usbtool_lost_transfers_total Transfers lost to errors while recovering.\n"
+                "# TYPE usbtool_lost_transfers_total counter\n"
+                "usbtool_lost_transfers_total %llu\n", snap->lost);
+    fprintf(fp, "# HELP usbtool_recoveries_total Recovered stalls, errors and disconnects.\n"
+                "# TYPE usbtool_recoveries_total counter\n"
+                "usbtool_recoveries_total %llu\n", snap->recoveries);
+    fprintf(fp, "# HELP usbtool_reconnects_total Recoveries which had to reopen the device.\n"
+                "# TYPE usbtool_reconnects_total counter\n"
+                "usbtool_reconnects_total %llu\n", snap->reconnects);
+    fprintf(fp, "# HELP usbtool_recovery_seconds_total Time spent recovering.\n"
+                "# TYPE usbtool_recovery_seconds_total counter\n"
+                "usbtool_recovery_seconds_total %.6f\n", snap->recoveryNs / 1e9);
+    fprintf(fp, "# HELP usbtool_in_flight Transfers submitted and not yet completed.\n"
+                "# TYPE usbtool_in_flight gauge\n"
+                "usbtool_in_flight %ld\n", snap->inFlight);
+    fprintf(fp, "# HELP usbtool_bytes_per_second Transfer rate over the last interval.\n"
+                "# TYPE usbtool_bytes_per_second gauge\n"
+                "usbtool_bytes_per_second %.1f\n", bytesPerSec);
+    fprintf(fp, "# HELP usbtool_transfers_per_second Transfers per second over the last interval.\n"
+                "# TYPE usbtool_transfers_per_second gauge\n"
+                "usbtool_transfers_per_second %.1f\n", transfersPerSec);
+    if(snap->compressIn > 0){
+        fprintf(fp, "# HELP usbtool_compress_input_bytes_total Bytes passed to the compressor.\n"
+                    "# TYPE usbtool_compress_input_bytes_total counter\n"
+                    "usbtool_compress_input_bytes_total %llu\n", snap->compressIn);
+        fprintf(fp, "# HELP usbtool_compress_output_bytes_total Compressed bytes written.\n"
+                    "# TYPE usbtool_compress_output_bytes_total counter\n"
+                    "usbtool_compress_output_bytes_total %llu\n", snap->compressOut);
+        fprintf(fp, "# HELP usbtool_compress_wait_seconds_total Time the output waited for the compressor.\n"
+                    "# TYPE usbtool_compress_wait_seconds_total counter\n"
+                    "usbtool_compress_wait_seconds_total %.6f\n", snap->compressWaitNs / 1e9);
+    }
+    if(snap->messages > 0 || snap->messagesDropped > 0){
+        fprintf(fp, "# HELP usbtool_messages_total Complete messages received.\n"
+                    "# TYPE usbtool_messages_total counter\n"
+                    "usbtool_messages_total %llu\n", snap->messages);
+        fprintf(fp, "# HELP usbtool_messages_dropped_total Incomplete messages dropped at gaps.\n"
+                    "# TYPE usbtool_messages_dropped_total counter\n"
+                    "usbtool_messages_dropped_total %llu\n", snap->messagesDropped);
+        fprintf(fp, "# HELP usbtool_messages_per_second Messages per second over the last interval.\n"
+                    "# TYPE usbtool_messages_per_second gauge\n"
+                    "usbtool_messages_per_second %.1f\n", messagesPerSec);
+    }
+    if(samples > 0){
+        fprintf(fp, "# HELP usbtool_latency_seconds Transfer latency quantiles over the last interval.\n"
+                    "# TYPE usbtool_latency_seconds gauge\n");
+        for(q = 0; q < NUM_QUANTILES; q++)
+            fprintf(fp, "usbtool_latency_seconds{quantile=\"%g\"} %.6f\n", quantiles[q], values[q] / 1e6);
+    }
+    if(fclose(fp) != 0 || rename(tmpName, statsFileName) != 0)
+        fprintf(stderr, "Error writing \"%s\": %s\n", statsFileName, strerror(errno));
+}
+
+static void report(void)
+{
+    usbStats snap;
+    unsigned long long values[NUM_QUANTILES], samples;
+    long long now = statsClockNs();
+    double seconds = (now - statsPreviousNs) / 1e9;
+    double bytesPerSec, transfersPerSec, messagesPerSec;
+
+    snapshot(&snap);
+    if(seconds <= 0)
+        seconds = 1e-9;
+    bytesPerSec = (snap.bytes - statsPrevious.bytes) / seconds;
+    transfersPerSec = (snap.transfers - statsPrevious.transfers) / seconds;
+    messagesPerSec = (snap.messages - statsPrevious.messages) / seconds;
+    samples = intervalQuantiles(&snap, values);
+    if(statsFileName != NULL){
+        writePrometheus(&snap, bytesPerSec, transfersPerSec, messagesPerSec, values, samples);
+    }else{
+        fprintf(statsOut, "stats: %.1f kB/s, %.1f transfers/s, %ld in flight, "
+                "%llu errors (%llu timeouts, %llu stalls), %llu overruns",
+                bytesPerSec / 1000, transfersPerSec, snap.inFlight,
+                snap.errors, snap.timeouts, snap.stalls, snap.overruns);
+        if(snap.recoveries > 0 || snap.lost > 0)
+            fprintf(statsOut, ", %llu recoveries (%llu reconnects, %.1f ms), %llu transfers lost",
+                    snap.recoveries, snap.reconnects, snap.recoveryNs / 1e6, snap.lost);
+        if(snap.messages > 0 || snap.messagesDropped > 0)
+            fprintf(statsOut, ", %.1f messages/s (%llu dropped)", messagesPerSec, snap.messagesDropped);
+        if(samples > 0)
+            fprintf(statsOut, ", latency p50/p90/p99/p99.9 %llu/%llu/%llu/%llu us",
+                    values[0], values[1], values[2], values[3]);
+        if(snap.compressOut > 0)
+            fprintf(statsOut, ", compression ratio %.2f, waited for compressor %.0f%%",
+                    (double)snap.compressIn / snap.compressOut,
+                    (snap.compressWaitNs - statsPrevious.compressWaitNs) / (seconds * 1e7));
+        fprintf(statsOut, "\n");
+        fflush(statsOut);
+    }
+    statsPrevious = snap;
+    statsPreviousNs = now;
+}
+
+static void *reporterThread(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&statsLock);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while(!statsStopping){
+        deadline.tv_sec += statsIntervalMs / 1000;
+        deadline.tv_nsec += (statsIntervalMs % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(!statsStopping
+              && pthread_cond_timedwait(&statsWakeup, &statsLock, &deadline) != ETIMEDOUT)
+            continue;
+        if(!statsStopping)
+            report();
+    }
+    pthread_mutex_unlock(&statsLock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int statsStart(usbStats *stats, int intervalMs, const char *fileName, FILE *out)
+{
+    statsCurrent = stats;
+    memset(&statsPrevious, 0, sizeof(statsPrevious));
+    statsPreviousNs = statsClockNs();
+    statsIntervalMs = intervalMs > 0 ? intervalMs : 1000;
+    statsFileName = fileName;
+    statsOut = out;
+    statsStopping = 0;
+    if(pthread_create(&statsThread, NULL, reporterThread, NULL) != 0){
+        statsCurrent = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void statsStop(void)
+{
+    if(statsCurrent == NULL)
+        return;
+    pthread_mutex_lock(&statsLock);
+    statsStopping = 1;
+    pthread_cond_signal(&statsWakeup);
+    pthread_mutex_unlock(&statsLock);
+    pthread_join(statsThread, NULL);
+    report();
+    statsCurrent = NULL;
+}
@@ -0,0 +1,94 @@
+/* Name: stats.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module keeps transfer counters and a latency histogram and reports them
+periodically from a separate thread. Each counter has a single writer (the
+thread handling the libusb events), so it is updated with plain relaxed
+atomic stores and never takes a lock. The reporter takes snapshots of the
+counters and computes rates and latency percentiles for the last interval.
+*/
+
+#ifndef __STATS_H_INCLUDED__
+#define __STATS_H_INCLUDED__
+
+#include <stdio.h>
+
+#define STATS_SUB_BITS      3   /* 8 histogram buckets per power of two */
+#define STATS_BUCKETS       ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+typedef struct usbStats {
+    unsigned long long  bytes;          /* bytes transferred */
+    unsigned long long  transfers;      /* completed transfers */
+    unsigned long long  errors;         /* failed transfers, including the ones below */
+    unsigned long long  timeouts;
+    unsigned long long  stalls;
+    unsigned long long  overruns;       /* received data dropped for lack of buffers */
+    unsigned long long  lost;           /* transfers lost to errors while recovering */
+    unsigned long long  recoveries;     /* recovered stalls, errors and disconnects */
+    unsigned long long  reconnects;     /* recoveries which had to reopen the device */
+    unsigned long long  recoveryNs;     /* time spent recovering */
+    long                inFlight;       /* submitted, not yet completed transfers */
+    unsigned long long  compressIn;     /* bytes passed to the compressor (see compress.h) */
+    unsigned long long  compressOut;    /* compressed bytes written */
+    unsigned long long  compressWaitNs; /* time spent waiting for the compressor */
+    unsigned long long  latency[STATS_BUCKETS]; /* submit to completion, microseconds */
+    unsigned long long  latencyMax;     /* largest latency, microseconds */
+    /* updated by the output thread in framed mode (see frame.h): */
+    unsigned long long  messages;       /* complete messages */
+    unsigned long long  messagesDropped;    /* incomplete messages dropped at gaps */
+    unsigned long long  interval[STATS_BUCKETS];    /* between message ends, microseconds */
+    unsigned long long  intervalMax;
+} usbStats;
+
+/* Single writer updates and reads from other threads: */
+#define STATS_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STATS_GET(field)    __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+long long statsClockNs(void);
+/* Returns the monotonic clock in nanoseconds. */
+
+void statsAddLatency(usbStats *stats, long long ns);
+/* Counts a transfer latency of 'ns' nanoseconds in the histogram. Must be
+ * called from the thread updating the other counters of 'stats'.
+ */
+
+void statsAddInterval(usbStats *stats, long long ns);
+/* Counts an interval of 'ns' nanoseconds between two messages in the
+ * message rate histogram. Must be called from the thread updating
+ * 'messages'.
+ */
+
+void statsPrintLatency(usbStats *stats, FILE *out);
+/* Prints the distribution of all latencies counted in 'stats' to 'out': the
+ * quantiles up to p99.99, the maximum and the counts per power of two. Must
+ * not be called while 'stats' is being updated.
+ */
+
+void statsPrintMessages(usbStats *stats, FILE *out);
+/* Like statsPrintLatency() for the intervals between messages, with the
+ * corresponding message rates.
+ */
+
+int statsStart(usbStats *stats, int intervalMs, const char *fileName, FILE *out);
+/* This function starts a thread which reports 'stats' every 'intervalMs'
+ * milliseconds. If 'fileName' is not NULL, the report is written to this
+ * file in the Prometheus text exposition format (for the textfile collector
+ * of node_exporter); the file is replaced atomically. Otherwise a one line
+ * summary is printed to 'out'.
+ * Returns: 0 on success or -1 if the thread can't be created.
+ */
+
+void statsStop(void);
+/* Stops the reporter thread started by statsStart(), if any, and reports
+ * the final state once more.
+ */
+
+#endif /* __STATS_H_INCLUDED__ */
@@ -0,0 +1,337 @@
+/* Name: stream.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Asynchronous interrupt and bulk transfer streaming based on libusb-1.0.
+See stream.h for the interface.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "stream.h"
+#include "sink.h"
+#include "trace.h"
+
+extern libusb_context* usbCtx;
+
+/* ------------------------------------------------------------------------- */
+
+struct streamSlot {
+    struct libusb_transfer  *transfer;
+    usbStream               *stream;
+    long                    seq;
+    long long               submitNs;
+    int                     active;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+#define RECOVER_NONE        0
+#define RECOVER_HALT        1   /* clear the halt and resubmit */
+#define RECOVER_REOPEN      2   /* the device is gone, reopen it */
+
+#define STREAM_MAX_RETRIES  10  /* recoveries in a row without any data */
+
+static long submitted;      /* number of submitted transfers, next sequence number */
+static int  stopping;       /* don't resubmit */
+static int  streamError;
+static int  recovering;     /* RECOVER_*, don't resubmit until done */
+static int  retries;        /* recoveries since the last completed transfer */
+static long long recoverStartNs;
+static int  gapPending;     /* received data has been dropped, mark it before the next data */
+
+void usbStreamStop(void)
+{
+    stopRequested = 1;
+}
+
+static int  transferError(enum libusb_transfer_status status)
+{
+    switch(status){
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+static int  submitSlot(struct streamSlot *slot)
+{
+    int r;
+
+    slot->seq = submitted;
+    slot->submitNs = statsClockNs();
+    if((r = libusb_submit_transfer(slot->transfer)) < 0)
+        return r;
+    traceEvent(TRACE_SUBMIT, slot->seq);   /* only once submitted, to pair with its completion */
+    submitted++;
+    STATS_ADD(slot->stream->stats.inFlight, 1);
+    slot->active = 1;
+    return 0;
+}
+
+/* Starts a recovery (or stops the stream if recovery is off) after 'error'. */
+static void failed(usbStream *s, int error)
+{
+    if(!s->recover || (error == LIBUSB_ERROR_NO_DEVICE && s->reopen == NULL)){
+        if(streamError == 0)
+            streamError = error;
+        stopping = 1;
+        return;
+    }
+    if(recovering == RECOVER_NONE)
+        recoverStartNs = statsClockNs();
+    if(error == LIBUSB_ERROR_NO_DEVICE)
+        recovering = RECOVER_REOPEN;
+    else if(recovering == RECOVER_NONE)
+        recovering = RECOVER_HALT;
+}
+
+/* passes received data on, 'partial' if the transfer did not complete
+ * normally; returns non-zero to stop
+ */
+static int  deliver(usbStream *s, struct libusb_transfer *transfer, long seq, int partial)
+{
+    if(s->sink && (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN){
+        unsigned char *buffer;
+
+        if((buffer = sinkGetBuffer()) == NULL){    /* writer is behind, drop the data */
+            STATS_ADD(s->stats.overruns, 1);
+            gapPending = 1;
+            return 0;
+        }
+        /* a run of dropped transfers is marked by one gap before the next data */
+        if(gapPending){
+            if(sinkPutGap(seq) != 0)
+                return 1;
+            gapPending = 0;
+        }
+        if(sinkPut(seq, transfer->buffer, transfer->actual_length, partial ? SINK_PARTIAL : 0) != 0)
+            return 1;
+        transfer->buffer = buffer;
+        return 0;
+    }
+    return s->handler != NULL && s->handler(s->context, seq, transfer->buffer, transfer->actual_length) != 0;
+}
+
+static void LIBUSB_CALL transferDone(struct libusb_transfer *transfer)
+{
+    struct streamSlot *slot = transfer->user_data;
+    usbStream *s = slot->stream;
+    long seq = slot->seq;
+    int r;
+
+    traceEvent(TRACE_COMPLETE, seq);
+    slot->active = 0;
+    STATS_ADD(s->stats.inFlight, -1);
+    switch(transfer->status){
+    case LIBUSB_TRANSFER_COMPLETED:
+        statsAddLatency(&s->stats, statsClockNs() - slot->submitNs);
+        STATS_ADD(s->stats.bytes, transfer->actual_length);
+        STATS_ADD(s->stats.transfers, 1);
+        retries = 0;
+        if(deliver(s, transfer, seq, 0))
+            stopping = 1;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        /* cancelled for a recovery: keep what has arrived */
+        if(recovering && transfer->actual_length > 0){
+            STATS_ADD(s->stats.bytes, transfer->actual_length);
+            if(deliver(s, transfer, seq, 1))
+                stopping = 1;
+        }
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        STATS_ADD(s->stats.errors, 1);
+        STATS_ADD(s->stats.timeouts, 1);
+        if(s->recover){     /* nothing is lost, just try again */
+            if(transfer->actual_length > 0){
+                STATS_ADD(s->stats.bytes, transfer->actual_length);
+                if(deliver(s, transfer, seq, 1))
+                    stopping = 1;
+            }
+            break;
+        }
+        failed(s, LIBUSB_ERROR_TIMEOUT);
+        break;
+    default:
+        STATS_ADD(s->stats.errors, 1);
+        if(transfer->status == LIBUSB_TRANSFER_STALL)
+            STATS_ADD(s->stats.stalls, 1);
+        if(s->recover)
+            STATS_ADD(s->stats.lost, 1);
+        failed(s, transferError(transfer->status));
+    }
+    if(!stopping && !stopRequested && !recovering && (s->count == 0 || submitted < s->count)){
+        if((r = submitSlot(slot)) < 0)
+            failed(s, r);
+    }
+    traceEvent(TRACE_CALLBACK_RETURN, seq);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Brings the endpoint or the device back after all transfers have been
+ * reaped and resubmits them. Returns 0 on success or a libusb error code.
+ */
+static int  recover(usbStream *s, struct streamSlot *slots, int n)
+{
+    int i, r = 0, what = recovering;
+
+    if(++retries > STREAM_MAX_RETRIES){
+        fprintf(stderr, "Giving up after %d recoveries without any data.\n", STREAM_MAX_RETRIES);
+        return streamError != 0 ? streamError : LIBUSB_ERROR_IO;
+    }
+    if(what == RECOVER_HALT){
+        if((r = libusb_clear_halt(s->handle, s->endpoint)) == LIBUSB_ERROR_NO_DEVICE && s->reopen != NULL)
+            what = RECOVER_REOPEN;
+        else if(r < 0)
+            fprintf(stderr, "Could not clear the halt of endpoint 0x%02x: %s\n",
+                    s->endpoint, libusb_error_name(r));
+    }
+    if(what == RECOVER_REOPEN){
+        fprintf(stderr, "Device disconnected, waiting for it to come back...\n");
+        if((r = s->reopen(s)) == 0){
+            for(i = 0; i < n; i++)
+                slots[i].transfer->dev_handle = s->handle;
+            STATS_ADD(s->stats.reconnects, 1);
+        }
+    }
+    if(r < 0)
+        return r;
+    recovering = RECOVER_NONE;
+    STATS_ADD(s->stats.recoveries, 1);
+    STATS_ADD(s->stats.recoveryNs, statsClockNs() - recoverStartNs);
+    fprintf(stderr, "%s after %.1f ms, resuming at transfer %ld.\n",
+            what == RECOVER_REOPEN ? "Device reopened" : "Endpoint halt cleared",
+            (statsClockNs() - recoverStartNs) / 1e6, submitted);
+    /* mark the gap in the data; for the sink, in front of the next data
+     * (see deliver()), which also retries it if the queue is full now
+     */
+    if(s->sink && (s->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN){
+        if(sinkPutGap(submitted) != 0){
+            fprintf(stderr, "Warning: could not queue the gap marker, retrying before the next data.\n");
+            gapPending = 1;
+        }
+    }else if(s->handler != NULL && s->handler(s->context, submitted, NULL, 0) != 0)
+        stopping = 1;
+    for(i = 0; i < n && !stopping && !stopRequested && !recovering; i++){
+        if(s->count > 0 && submitted >= s->count)
+            break;
+        if((r = submitSlot(&slots[i])) < 0)
+            failed(s, r);
+    }
+    return 0;
+}
+
+int usbStreamRun(usbStream *s)
+{
+    struct streamSlot *slots;
+    int i, n, r, isIn, cancelled = 0;
+
+    isIn = (s->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+    n = s->depth < 1 ? 1 : s->depth;
+    if(s->count > 0 && s->count < n)
+        n = s->count;
+    if((slots = calloc(n, sizeof(*slots))) == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    submitted = 0;
+    stopping = 0;
+    streamError = 0;
+    recovering = RECOVER_NONE;
+    retries = 0;
+    gapPending = 0;
+
+    for(i = 0; i < n; i++){
+        unsigned char *buffer = s->sendBytes;
+        int len = s->sendByteCount;
+
+        if(isIn){
+            len = s->bufferSize;
+            if((buffer = s->sink ? sinkGetBuffer() : malloc(len)) == NULL){
+                if(s->sink && i > 0){   /* the pool is short, keep fewer transfers in flight */
+                    fprintf(stderr, "Warning: only %d output buffers for %d transfers in flight.\n", i, n);
+                    n = i;
+                }else{
+                    streamError = LIBUSB_ERROR_NO_MEM;
+                }
+                break;
+            }
+        }
+        if((slots[i].transfer = libusb_alloc_transfer(0)) == NULL){
+            if(isIn && !s->sink)
+                free(buffer);
+            streamError = LIBUSB_ERROR_NO_MEM;
+            break;
+        }
+        if(s->type == LIBUSB_TRANSFER_TYPE_INTERRUPT){
+            libusb_fill_interrupt_transfer(slots[i].transfer, s->handle, s->endpoint,
+                                           buffer, len, transferDone, &slots[i], s->timeout);
+        }else{
+            libusb_fill_bulk_transfer(slots[i].transfer, s->handle, s->endpoint,
+                                      buffer, len, transferDone, &slots[i], s->timeout);
+        }
+        slots[i].stream = s;
+    }
+    for(i = 0; i < n && streamError == 0 && !stopRequested; i++){
+        if((r = submitSlot(&slots[i])) < 0)
+            streamError = r;
+    }
+    if(streamError != 0)
+        stopping = 1;
+
+    for(;;){
+        struct timeval tv = { 0, s->busyPoll ? 0 : 100000 };
+
+        if(s->stats.inFlight == 0){
+            if(!recovering || stopping || stopRequested)
+                break;
+            if((r = recover(s, slots, n)) < 0){
+                if(!(r == LIBUSB_ERROR_INTERRUPTED && stopRequested))    /* not stopped while waiting */
+                    streamError = r;
+                break;
+            }
+            cancelled = 0;
+            continue;
+        }
+        if((stopping || stopRequested || recovering) && !cancelled){
+            for(i = 0; i < n; i++){
+                if(slots[i].active)
+                    libusb_cancel_transfer(slots[i].transfer);
+            }
+            cancelled = 1;
+        }
+        r = libusb_handle_events_timeout_completed(usbCtx, &tv, NULL);
+        if(r < 0 && r != LIBUSB_ERROR_INTERRUPTED){
+            /* The transfers still in flight can't be reaped now, so they
+             * are left allocated.
+             */
+            return streamError != 0 ? streamError : r;
+        }
+    }
+
+    for(i = 0; i < n; i++){
+        if(slots[i].transfer != NULL){
+            if(isIn && !s->sink)     /* sink buffers are freed by sinkStop() */
+                free(slots[i].transfer->buffer);
+            libusb_free_transfer(slots[i].transfer);
+        }
+    }
+    free(slots);
+    return streamError;
+}
@@ -0,0 +1,86 @@
+/* Name: stream.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module runs a sequence of interrupt or bulk transfers on one endpoint
+using the asynchronous libusb-1.0 API. A configurable number of transfers is
+kept in flight so that the device never waits for the host between two
+transfers. Completed transfers are passed to a handler function on the
+thread which handles the libusb events (the thread calling usbStreamRun())
+or, for IN endpoints, queued to the output sink (see sink.h) without copying.
+
+With 'recover' set, the stream survives errors: after a stall or another
+transfer error it waits for the transfers in flight, clears the halt of the
+endpoint and resubmits; after a disconnect it calls the 'reopen' function,
+which waits for the device to come back, and resumes on the new handle.
+Each such gap in the data is reported to the handler (or the sink).
+*/
+
+#ifndef __STREAM_H_INCLUDED__
+#define __STREAM_H_INCLUDED__
+
+#include <libusb.h>
+#include "stats.h"
+
+typedef int (*usbStreamHandler)(void *context, long seq, unsigned char *data, int len);
+/* Called for each successfully completed transfer with its sequence number
+ * 'seq' (counting from 0 in order of submission). For IN endpoints 'data'
+ * and 'len' describe the received bytes, for OUT endpoints the sent bytes.
+ * After a recovery it is called with 'data' NULL and 'len' 0 to mark the
+ * gap before transfer 'seq'.
+ * Return 0 to continue streaming, non-zero to stop.
+ */
+
+struct usbStream;
+
+typedef int (*usbStreamReopen)(struct usbStream *stream);
+/* Called after the device has gone away, with no transfers in flight. Waits
+ * for the device to come back, opens and prepares it and stores the new
+ * handle in 'stream->handle'. The old handle is no longer used by the
+ * stream.
+ * Returns: 0 on success or a negative libusb error code to give up.
+ */
+
+typedef struct usbStream {
+    /* parameters, filled in by the caller: */
+    libusb_device_handle    *handle;
+    unsigned char           endpoint;       /* including the direction bit */
+    unsigned char           type;           /* LIBUSB_TRANSFER_TYPE_BULK or _INTERRUPT */
+    int                     bufferSize;     /* bytes per IN transfer */
+    unsigned char           *sendBytes;     /* payload of each OUT transfer */
+    int                     sendByteCount;
+    int                     depth;          /* number of transfers in flight */
+    long                    count;          /* number of transfers, 0 for no limit */
+    unsigned int            timeout;        /* per transfer, in milliseconds */
+    usbStreamHandler        handler;
+    void                    *context;       /* passed to the handler */
+    int                     sink;           /* pass IN data to the output sink (see sink.h) */
+    int                     recover;        /* recover from errors instead of stopping */
+    usbStreamReopen         reopen;         /* NULL to stop when the device is gone */
+    int                     busyPoll;       /* poll for events without ever sleeping */
+    /* counters, updated by usbStreamRun() (see stats.h): */
+    usbStats                stats;
+} usbStream;
+
+int usbStreamRun(usbStream *stream);
+/* This function submits up to 'depth' transfers and resubmits each one as it
+ * completes until 'count' transfers are done, the handler asks to stop,
+ * usbStreamStop() is called or an error occurs (which can't be recovered
+ * from). In-flight transfers are cancelled and reaped before the function
+ * returns. Transfers lost to errors count towards 'count'.
+ * Returns: 0 on success or a negative libusb error code.
+ */
+
+void usbStreamStop(void);
+/* Requests the running stream to stop. This function is async-signal-safe
+ * and may be called from a signal handler.
+ */
+
+#endif /* __STREAM_H_INCLUDED__ */
@@ -0,0 +1,198 @@
+/* Name: trace.c
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+Per-thread transfer event recording and Chrome trace-event JSON output.
+See trace.h for the interface.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+struct traceRecord {
+    long long   ns;     /* nanoseconds since traceOpen() */
+    long        seq;
+    int         kind;
+};
+
+struct traceBuffer {
+    struct traceBuffer  *next;
+    int                 tid;
+    char                name[32];
+    int                 count;
+    long                dropped;
+    struct traceRecord  records[];
+};
+
+int traceEnabled = 0;
+
+static FILE                 *traceFp = NULL;
+static int                  traceCapacity = TRACE_DEFAULT_EVENTS;
+static long long            traceStart;
+static struct traceBuffer   *traceBuffers = NULL;
+static int                  traceThreads = 0;
+static pthread_mutex_t      traceLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct traceBuffer *localBuffer = NULL;
+
+static long long    monotonicNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int traceOpen(const char *fileName, int eventsPerThread)
+{
+    if((traceFp = fopen(fileName, "w")) == NULL)
+        return -1;
+    if(eventsPerThread > 0)
+        traceCapacity = eventsPerThread;
+    traceStart = monotonicNs();
+    traceEnabled = 1;
+    return 0;
+}
+
+void traceThreadInit(const char *threadName)
+{
+    struct traceBuffer *b;
+    size_t size;
+
+    if(!traceEnabled || localBuffer != NULL)
+        return;
+    size = sizeof(*b) + (size_t)traceCapacity * sizeof(b->records[0]);
+    if((b = malloc(size)) == NULL)
+        return;
+    memset(b, 0, size);     /* touch all pages now rather than while tracing */
+    pthread_mutex_lock(&traceLock);
+    b->tid = ++traceThreads;
+    b->next = traceBuffers;
+    traceBuffers = b;
+    pthread_mutex_unlock(&traceLock);
+    if(threadName != NULL)
+        snprintf(b->name, sizeof(b->name), "%s", threadName);
+    else
+        snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+    localBuffer = b;
+}
+
+void traceRecord(int kind, long seq)
+{
+    struct traceBuffer *b = localBuffer;
+    struct traceRecord *rec;
+
+    if(b == NULL){
+        traceThreadInit(NULL);
+        if((b = localBuffer) == NULL)
+            return;
+    }
+    if(b->count >= traceCapacity){
+        b->dropped++;
+        return;
+    }
+    rec = &b->records[b->count++];
+    rec->ns = monotonicNs() - traceStart;
+    rec->seq = seq;
+    rec->kind = kind;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void writeEvent(FILE *fp, int *first, struct traceBuffer *b,
+                       struct traceRecord *rec, const char *name, const char *phase)
+{
+    /* writes have their own category: async ones reuse the transfer numbers as ids */
+    const char *cat = strcmp(name, "write") == 0 || strcmp(name, "compress") == 0 ? "output" : "usb";
+
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%lld.%03lld", *first ? "" : ",", name, cat, phase, b->tid,
+            rec->ns / 1000, rec->ns % 1000);
+    if(phase[0] == 'b' || phase[0] == 'e')  /* async events are matched by id */
+        fprintf(fp, ",\"id\":%ld", rec->seq);
+    else
+        fprintf(fp, ",\"args\":{\"seq\":%ld}", rec->seq);
+    fprintf(fp, "}");
+    *first = 0;
+}
+
+int traceClose(void)
+{
+    struct traceBuffer *b, *next;
+    int i, first = 1, r = 0;
+
+    if(traceFp == NULL)
+        return 0;
+    traceEnabled = 0;
+    fprintf(traceFp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for(b = traceBuffers; b != NULL; b = b->next){
+        fprintf(traceFp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", first ? "" : ",", b->tid, b->name);
+        first = 0;
+        for(i = 0; i < b->count; i++){
+            struct traceRecord *rec = &b->records[i];
+            switch(rec->kind){
+            case TRACE_SUBMIT:
+                writeEvent(traceFp, &first, b, rec, "transfer", "b");
+                break;
+            case TRACE_COMPLETE:
+                writeEvent(traceFp, &first, b, rec, "transfer", "e");
+                writeEvent(traceFp, &first, b, rec, "callback", "B");
+                break;
+            case TRACE_CALLBACK_RETURN:
+                writeEvent(traceFp, &first, b, rec, "callback", "E");
+                break;
+            case TRACE_WRITE_BEGIN:
+                writeEvent(traceFp, &first, b, rec, "write", "B");
+                break;
+            case TRACE_WRITE_END:
+                writeEvent(traceFp, &first, b, rec, "write", "E");
+                break;
+            case TRACE_WRITE_SUBMIT:
+                writeEvent(traceFp, &first, b, rec, "write", "b");
+                break;
+            case TRACE_WRITE_COMPLETE:
+                writeEvent(traceFp, &first, b, rec, "write", "e");
+                break;
+            case TRACE_COMPRESS_BEGIN:
+                writeEvent(traceFp, &first, b, rec, "compress", "B");
+                break;
+            case TRACE_COMPRESS_END:
+                writeEvent(traceFp, &first, b, rec, "compress", "E");
+                break;
+            }
+        }
+        if(b->dropped > 0)
+            fprintf(stderr, "Warning: trace buffer of \"%s\" is full, %ld events dropped.\n",
+                    b->name, b->dropped);
+    }
+    fprintf(traceFp, "\n]}\n");
+    if(ferror(traceFp))
+        r = -1;
+    if(fclose(traceFp) != 0)
+        r = -1;
+    traceFp = NULL;
+    pthread_mutex_lock(&traceLock);
+    for(b = traceBuffers; b != NULL; b = next){
+        next = b->next;
+        free(b);
+    }
+    traceBuffers = NULL;
+    pthread_mutex_unlock(&traceLock);
+    localBuffer = NULL;
+    return r;
+}
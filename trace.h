@@ -0,0 +1,66 @@
+/* Name: trace.h
+ * Project: usbtool
+ * Author: Paul Wolneykien
+ * Creation Date: 2026-10-18
+ * Tabsize: 4
+ * Copyright: (c) 2026 Paul Wolneykien
+ * License: GNU GPL v3 (see COPYING)
+ */
+
+/*
+General Description:
+This module records timestamps of transfer events into per-thread buffers
+which are allocated in advance, and writes them out as a Chrome trace-event
+JSON file when tracing is finished. The file can be opened with Perfetto
+(https://ui.perfetto.dev/) or chrome://tracing. When tracing is not enabled,
+each trace point costs a single test of a global flag.
+*/
+
+#ifndef __TRACE_H_INCLUDED__
+#define __TRACE_H_INCLUDED__
+
+/* trace event kinds: */
+#define TRACE_SUBMIT            0   /* transfer submitted to libusb */
+#define TRACE_COMPLETE          1   /* transfer completion callback entered */
+#define TRACE_CALLBACK_RETURN   2   /* transfer completion callback returns */
+#define TRACE_WRITE_BEGIN       3   /* writing of the transfer data begins */
+#define TRACE_WRITE_END         4   /* writing of the transfer data is done */
+#define TRACE_WRITE_SUBMIT      5   /* asynchronous write submitted (io_uring) */
+#define TRACE_WRITE_COMPLETE    6   /* asynchronous write completed */
+#define TRACE_COMPRESS_BEGIN    7   /* compression of a chunk begins */
+#define TRACE_COMPRESS_END      8   /* compression of a chunk is done */
+
+#define TRACE_DEFAULT_EVENTS    262144  /* events per thread */
+
+extern int traceEnabled;
+
+#define traceEvent(kind, seq) \
+    do{ if(traceEnabled) traceRecord((kind), (seq)); }while(0)
+/* Records an event of the given kind for the transfer with the sequence
+ * number 'seq' in the buffer of the calling thread. Use this macro rather
+ * than calling traceRecord() directly.
+ */
+
+int traceOpen(const char *fileName, int eventsPerThread);
+/* This function enables tracing. The output file is created at once in
+ * order to report errors early; it is written by traceClose(). Each thread
+ * can record up to 'eventsPerThread' events, the rest is dropped.
+ * Returns: 0 on success or -1 if the file can't be created (errno is set).
+ */
+
+void traceThreadInit(const char *threadName);
+/* Allocates and prefaults the event buffer of the calling thread and sets
+ * the thread name shown in the trace viewer. Threads which record events
+ * without calling this function get a buffer on their first event.
+ */
+
+void traceRecord(int kind, long seq);
+/* Slow path of traceEvent(). */
+
+int traceClose(void);
+/* Writes all recorded events to the file given to traceOpen() and disables
+ * tracing. All threads recording events must have finished.
+ * Returns: 0 on success or -1 on write error (errno is set).
+ */
+
+#endif /* __TRACE_H_INCLUDED__ */
@@ -17,6 +17,8 @@ the USB bus from Linux, FreeBSD, Mac OS X and other Unix operating systems.
 Libusb can be obtained from http://libusb.sourceforge.net/.
 */
 
+#define _GNU_SOURCE /* O_DIRECT */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,9 +28,21 @@ Libusb can be obtained from http://libusb.sourceforge.net/.
 #include <errno.h>
 #include <strings.h>
 #include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <libusb.h>
 #include "opendevice.h" /* common code moved to separate module */
+#include "devinfo.h"
+#include "stream.h"
+#include "download.h"
+#include "realtime.h"
+#include "frame.h"
+#include "sink.h"
+#include "compress.h"
+#include "stats.h"
+#include "trace.h"
 
 #define DEFAULT_USB_VID         0   /* any */
 #define DEFAULT_USB_PID         0   /* any */
@@ -41,25 +55,48 @@ static void usage(char *name)
         "  -h or -? (print this help and exit)\n"
         "  -v <vendor-id> (defaults to 0x%x, can be '*' for any VID)\n"
         "  -p <product-id> (defaults to 0x%x, can be '*' for any PID)\n"
-        "  -V <vendor-name-pattern> (shell style matching, defaults to '*')\n"
-        "  -P <product-name-pattern> (shell style matching, defaults to '*')\n"
-        "  -S <serial-pattern> (shell style matching, defaults to '*')\n"
+        "  -V <vendor-name-pattern> (shell style matching, defaults to '*', may be repeated)\n"
+        "  -P <product-name-pattern> (shell style matching, defaults to '*', may be repeated)\n"
+        "  -S <serial-pattern> (shell style matching, defaults to '*', may be repeated)\n"
         "  -d <databytes> (data byte for request, comma separated list)\n"
         "  -D <file> (binary data for request taken from file)\n"
         "  -O <file> (write received data bytes to file)\n"
         "  -b (binary output format, default is hex)\n"
         "  -n <count> (maximum number of bytes to receive)\n"
+        "  -N <count> (number of interrupt or bulk transfers, 0 for no limit, defaults to 1)\n"
+        "  -q <depth> (number of interrupt or bulk transfers kept in flight, defaults to 1)\n"
         "  -e <endpoint> (specify endpoint for some commands)\n"
         "  -t <timeout> (specify USB timeout in milliseconds)\n"
         "  -c <configuration> (device configuration to choose)\n"
         "  -i <interface> (configuration interface to claim)\n"
         "  -w (suppress USB warnings, default is verbose)\n"
         "  -I (show more information about each device in the list)\n"
+        "  --trace <file> (write transfer timing as Chrome trace-event JSON to file)\n"
+        "  --stats-interval <ms> (report transfer statistics periodically)\n"
+        "  --stats-file <file> (write statistics to file in Prometheus text format)\n"
+        "  --buffers <count> (number of buffers for received data, defaults to 2 * depth + 32)\n"
+        "  --direct (write binary output file with O_DIRECT)\n"
+        "  --compress lz4|zstd[:level] (compress binary output of interrupt and bulk IN)\n"
+        "  --compress-threads <count> (number of compression threads, defaults to 1)\n"
+        "  --block-size <count> (bytes per request of control download, defaults to 4096)\n"
+        "  --address none|value|index|long[:step] (how control download advances the address)\n"
+        "  --verify (read back each block of control download and compare)\n"
+        "  --verify-request <request> (request to read back with, defaults to the download request)\n"
+        "  --format text|json|binary (output format of the info command, defaults to text)\n"
+        "  --recover (interrupt and bulk: recover from stalls, errors and re-plugs)\n"
+        "  --cpu <cpu> (interrupt and bulk: pin the event thread to this CPU)\n"
+        "  --rt-priority <1-99> (interrupt and bulk: run the event thread with SCHED_FIFO)\n"
+        "  --lock-memory (interrupt and bulk: lock all memory and prefault the stack)\n"
+        "  --busy-poll (interrupt and bulk: poll for completions without sleeping)\n"
+        "  --latency (print the transfer latency distribution at the end)\n"
+        "  --framed (interrupt and bulk IN: output messages ended by short packets)\n"
+        "  --timestamps (with --framed: write the completion time of each message)\n"
         "\n"
         "Commands are:\n"
         "  list (list all matching devices by name)\n"
         "  info (print information about each matching device)\n"
         "  control in|out <type> <recipient> <request> <value> <index> (send control request)\n"
+        "  control download <type> <recipient> <request> <value> <index> (send data of any size)\n"
         "  interrupt in|out (send or receive interrupt data)\n"
         "  bulk in|out (send or receive bulk data)\n"
         "For valid enum values for <type> and <recipient> pass \"x\" for the value.\n"
@@ -78,9 +115,9 @@ libusb_context* usbCtx = NULL;
 
 static int  vendorID = DEFAULT_USB_VID;
 static int  productID = DEFAULT_USB_PID;
-static char *vendorNamePattern = "*";
-static char *productNamePattern = "*";
-static char *serialPattern = "*";
+static char *vendorNamePattern = NULL;
+static char *productNamePattern = NULL;
+static char *serialPattern = NULL;
 static char *sendBytes = NULL;
 static int  sendByteCount;
 static char *outputFile = NULL;
@@ -92,6 +129,33 @@ static int  usbTimeout = 5000;
 static int  usbCount = 64;
 static int  usbConfiguration = 1;
 static int  usbInterface = 0;
+static long usbTransferCount = 1;
+static int  usbQueueDepth = 1;
+static char *traceFile = NULL;
+static int  statsInterval = 0;
+static char *statsFile = NULL;
+static int  sinkBuffers = 0;
+static int  directOutput = 0;
+static int  compressMethod = COMPRESS_NONE;
+static int  compressLevel = 0;
+static int  compressThreads = 1;
+static int  downloadBlockSize = 4096;
+static int  downloadAddressing = DOWNLOAD_ADDRESS_NONE;
+static long downloadStep = 0;
+static int  downloadVerify = 0;
+static int  downloadVerifyRequest = -1;
+static int  infoFormat = USBINFO_TEXT;
+static int  recoverStream = 0;
+static int  eventCpu = -1;
+static int  eventPriority = 0;
+static int  lockMemory = 0;
+static int  realtimeMissing = 0;    /* REALTIME_* settings not applied */
+static int  busyPoll = 0;
+static int  latencyReport = 0;
+static int  framed = 0;
+static int  frameTimestamps = 0;
+static volatile sig_atomic_t interrupted = 0;
+static int  deviceArrived;
 
 static int  usbDirection, usbType, usbRecipient, usbRequest, usbValue, usbIndex; /* arguments of control transfer */
 
@@ -117,6 +181,25 @@ static int  myAtoi(char *text)
     return l;
 }
 
+/* Appends 'pattern' to the comma separated pattern list 'list' (which may be
+ * NULL or a list returned before, which is reused). Repeated -V, -P and -S
+ * options are matched as one set.
+ */
+static char *addPattern(char *list, char *pattern)
+{
+    size_t  len = list != NULL ? strlen(list) + 1 : 0;
+    char    *s;
+
+    if((s = realloc(list, len + strlen(pattern) + 1)) == NULL){
+        fprintf(stderr, "Error: out of memory for the pattern \"%s\"\n", pattern);
+        exit(1);
+    }
+    if(len > 0)
+        s[len - 1] = ',';
+    strcpy(s + len, pattern);
+    return s;
+}
+
 static int  parseEnum(char *text, ...)
 {
     va_list vlist;
@@ -147,19 +230,203 @@ static int  parseEnum(char *text, ...)
 
 /* ------------------------------------------------------------------------- */
 
+/* Writes the received data in the format selected by the -b option.
+ * Signature of usbStreamHandler: 'context' is the output FILE pointer.
+ */
+static int  writeReceived(void *context, long seq, unsigned char *data, int len)
+{
+    FILE    *fp = context;
+    int     i;
+
+    if(data == NULL){   /* gap after a recovery, marked in hex output only */
+        if(!outputFormatIsBinary)
+            fprintf(fp, "# gap before transfer %ld\n", seq);
+        return ferror(fp) ? -1 : 0;
+    }
+    traceEvent(TRACE_WRITE_BEGIN, seq);
+    if(outputFormatIsBinary){
+        fwrite(data, 1, len, fp);
+    }else{
+        for(i = 0; i < len; i++){
+            if(i != 0){
+                if(i % 16 == 0){
+                    fprintf(fp, "\n");
+                }else{
+                    fprintf(fp, " ");
+                }
+            }
+            fprintf(fp, "0x%02x", data[i] & 0xff);
+        }
+        if(i != 0)
+            fprintf(fp, "\n");
+    }
+    traceEvent(TRACE_WRITE_END, seq);
+    return ferror(fp) ? -1 : 0;
+}
+
+/* Writes data as is. Signature of usbSinkWriter: 'context' is the output FILE
+ * pointer.
+ */
+static int  writeOutput(void *context, long seq, unsigned char *data, int len)
+{
+    int r;
+
+    traceEvent(TRACE_WRITE_BEGIN, seq);
+    r = fwrite(data, 1, len, context) == len ? 0 : -1;
+    traceEvent(TRACE_WRITE_END, seq);
+    return r;
+}
+
+static void onSignal(int sig)
+{
+    interrupted = 1;
+    usbStreamStop();
+    usbDownloadStop();
+}
+
+/* Sets the configuration and claims the interface given on the command line. */
+static void prepareInterface(libusb_device_handle *handle)
+{
+    int r, len, retries = 1;
+
+    if((r = libusb_set_configuration(handle, usbConfiguration)) && showWarnings){
+        fprintf(stderr, "Warning: could not set configuration: %s\n", libusb_error_name(r));
+    }
+    /* now try to claim the interface and detach the kernel HID driver on
+     * linux and other operating systems which support the call.
+     */
+    while((len = libusb_claim_interface(handle, usbInterface)) != 0 && retries-- > 0) {
+#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+        if ((r = libusb_detach_kernel_driver(handle, 0)) < 0 && showWarnings) {
+            fprintf(stderr, "Warning: could not detach kernel driver: %s\n", libusb_error_name(r));
+        }
+#endif
+    }
+    if(len != 0 && showWarnings)
+        fprintf(stderr, "Warning: could not claim interface: %s\n", libusb_error_name(len));
+}
+
+static int LIBUSB_CALL onHotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *userData)
+{
+    deviceArrived = 1;
+    return 0;
+}
+
+/* Waits for a device matching the command line options to (re)appear, opens
+ * it and claims the interface. Signature of usbStreamReopen. Without hotplug
+ * support the devices are polled once a second.
+ */
+static int  reopenDevice(usbStream *stream)
+{
+    libusb_hotplug_callback_handle callback;
+    libusb_device_handle *handle = NULL;
+    long long lastTry = 0;
+    int hotplug;
+
+    libusb_close(stream->handle);
+    stream->handle = NULL;
+    deviceArrived = 0;
+    hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+              && libusb_hotplug_register_callback(usbCtx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                                  LIBUSB_HOTPLUG_NO_FLAGS,
+                                                  vendorID ? vendorID : LIBUSB_HOTPLUG_MATCH_ANY,
+                                                  productID ? productID : LIBUSB_HOTPLUG_MATCH_ANY,
+                                                  LIBUSB_HOTPLUG_MATCH_ANY, onHotplug, NULL, &callback) == 0;
+    while(!interrupted){
+        /* a missed arrival is caught by trying once a second anyway */
+        if(deviceArrived || statsClockNs() - lastTry >= 1000000000LL){
+            deviceArrived = 0;
+            lastTry = statsClockNs();
+            if(usbOpenDevice(&handle, vendorID, vendorNamePattern, productID, productNamePattern,
+                             serialPattern, NULL, NULL, 0) == USBOPEN_SUCCESS && handle != NULL)
+                break;
+            handle = NULL;
+        }
+        if(hotplug){
+            struct timeval tv = { 0, 100000 };
+
+            libusb_handle_events_timeout_completed(usbCtx, &tv, NULL);
+        }else{
+            struct timespec pause = { 0, 100000000L };
+
+            nanosleep(&pause, NULL);
+        }
+    }
+    if(hotplug)
+        libusb_hotplug_deregister_callback(usbCtx, callback);
+    if(handle == NULL)
+        return LIBUSB_ERROR_INTERRUPTED;
+    prepareInterface(handle);
+    stream->handle = handle;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define OPT_TRACE           256
+#define OPT_STATS_INTERVAL  257
+#define OPT_STATS_FILE      258
+#define OPT_BUFFERS         259
+#define OPT_DIRECT          260
+#define OPT_COMPRESS        261
+#define OPT_COMPRESS_THREADS 262
+#define OPT_BLOCK_SIZE      263
+#define OPT_ADDRESS         264
+#define OPT_VERIFY          265
+#define OPT_VERIFY_REQUEST  266
+#define OPT_FORMAT          267
+#define OPT_RECOVER         268
+#define OPT_CPU             269
+#define OPT_RT_PRIORITY     270
+#define OPT_LOCK_MEMORY     271
+#define OPT_BUSY_POLL       272
+#define OPT_LATENCY         273
+#define OPT_FRAMED          274
+#define OPT_TIMESTAMPS      275
+
+static struct option longOptions[] = {
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    { "stats-file", required_argument, NULL, OPT_STATS_FILE },
+    { "buffers", required_argument, NULL, OPT_BUFFERS },
+    { "direct", no_argument, NULL, OPT_DIRECT },
+    { "compress", required_argument, NULL, OPT_COMPRESS },
+    { "compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS },
+    { "block-size", required_argument, NULL, OPT_BLOCK_SIZE },
+    { "address", required_argument, NULL, OPT_ADDRESS },
+    { "verify", no_argument, NULL, OPT_VERIFY },
+    { "verify-request", required_argument, NULL, OPT_VERIFY_REQUEST },
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { "recover", no_argument, NULL, OPT_RECOVER },
+    { "cpu", required_argument, NULL, OPT_CPU },
+    { "rt-priority", required_argument, NULL, OPT_RT_PRIORITY },
+    { "lock-memory", no_argument, NULL, OPT_LOCK_MEMORY },
+    { "busy-poll", no_argument, NULL, OPT_BUSY_POLL },
+    { "latency", no_argument, NULL, OPT_LATENCY },
+    { "framed", no_argument, NULL, OPT_FRAMED },
+    { "timestamps", no_argument, NULL, OPT_TIMESTAMPS },
+    { NULL, 0, NULL, 0 }
+};
+
 #define ACTION_LIST         0
 #define ACTION_CONTROL      1
 #define ACTION_INTERRUPT    2
 #define ACTION_BULK         3
 
+#define DIRECTION_OUT       0
+#define DIRECTION_IN        1
+#define DIRECTION_DOWNLOAD  2   /* control only */
+
 int main(int argc, char **argv)
 {
     libusb_device_handle  *handle = NULL;
     int             opt, len, action, argcnt, r;
+    long long       bytes = 0;
+    int             outputError = 0;
     char            *myName = argv[0], *s, *rxBuffer = NULL;
-    FILE            *fp;
+    FILE            *fp, *outFp = NULL;
 
-    while((opt = getopt(argc, argv, "?hv:p:V:P:S:d:D:O:e:n:t:bw")) != -1){
+    while((opt = getopt_long(argc, argv, "?hv:p:V:P:S:d:D:O:e:n:N:q:t:bw", longOptions, NULL)) != -1){
         switch(opt){
         case 'h':
         case '?':   /* -h or -? (print this help and exit) */
@@ -172,13 +439,13 @@ int main(int argc, char **argv)
             productID = myAtoi(optarg);
             break;
         case 'V':   /* -V <vendor-name-pattern> (shell style matching, defaults to '*') */
-            vendorNamePattern = optarg;
+            vendorNamePattern = addPattern(vendorNamePattern, optarg);
             break;
         case 'P':   /* -P <product-name-pattern> (shell style matching, defaults to '*') */
-            productNamePattern = optarg;
+            productNamePattern = addPattern(productNamePattern, optarg);
             break;
         case 'S':   /* -S <serial-pattern> (shell style matching, defaults to '*') */
-            serialPattern = optarg;
+            serialPattern = addPattern(serialPattern, optarg);
             break;
         case 'd':   /* -d <databytes> (data bytes for requests given on command line) */
             while((s = strtok(optarg, ", ")) != NULL){
@@ -223,6 +490,97 @@ int main(int argc, char **argv)
         case 'n':   /* -n <count> (maximum number of bytes to receive) */
             usbCount = myAtoi(optarg);
             break;
+        case 'N':   /* -N <count> (number of interrupt or bulk transfers) */
+            usbTransferCount = myAtoi(optarg);
+            break;
+        case 'q':   /* -q <depth> (number of interrupt or bulk transfers kept in flight) */
+            usbQueueDepth = myAtoi(optarg);
+            break;
+        case OPT_TRACE: /* --trace <file> (write transfer timing to file) */
+            traceFile = optarg;
+            break;
+        case OPT_STATS_INTERVAL:    /* --stats-interval <ms> (report transfer statistics periodically) */
+            statsInterval = myAtoi(optarg);
+            break;
+        case OPT_STATS_FILE:    /* --stats-file <file> (write statistics in Prometheus text format) */
+            statsFile = optarg;
+            break;
+        case OPT_BUFFERS:   /* --buffers <count> (number of buffers for received data) */
+            sinkBuffers = myAtoi(optarg);
+            break;
+        case OPT_DIRECT:    /* --direct (write binary output file with O_DIRECT) */
+            directOutput = 1;
+            break;
+        case OPT_COMPRESS:  /* --compress lz4|zstd[:level] (compress binary output) */
+            if(compressParse(optarg, &compressMethod, &compressLevel) != 0){
+                fprintf(stderr, "Compression \"%s\" not supported. Supported are:\n", optarg);
+#ifdef HAVE_LZ4
+                fprintf(stderr, "  lz4[:level]\n");
+#endif
+#ifdef HAVE_ZSTD
+                fprintf(stderr, "  zstd[:level]\n");
+#endif
+                exit(1);
+            }
+            break;
+        case OPT_COMPRESS_THREADS:  /* --compress-threads <count> (number of compression threads) */
+            compressThreads = myAtoi(optarg);
+            break;
+        case OPT_BLOCK_SIZE:    /* --block-size <count> (bytes per request of control download) */
+            downloadBlockSize = myAtoi(optarg);
+            if(downloadBlockSize < 1 || downloadBlockSize > 0xffff){
+                fprintf(stderr, "Block size must be between 1 and 65535.\n");
+                exit(1);
+            }
+            break;
+        case OPT_ADDRESS:   /* --address none|value|index|long[:step] (address scheme of control download) */
+            if(usbDownloadParseAddress(optarg, &downloadAddressing, &downloadStep) != 0){
+                fprintf(stderr, "Address scheme \"%s\" not allowed. Allowed are none, value, index and long with optional :<step>.\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_VERIFY:    /* --verify (read back each block of control download) */
+            downloadVerify = 1;
+            break;
+        case OPT_VERIFY_REQUEST:    /* --verify-request <request> (request to read back with) */
+            downloadVerifyRequest = myAtoi(optarg);
+            downloadVerify = 1;
+            break;
+        case OPT_FORMAT:    /* --format text|json|binary (output format of the info command) */
+            infoFormat = USBINFO_TEXT + parseEnum(optarg, "text", "json", "binary", NULL);
+            break;
+        case OPT_RECOVER:   /* --recover (recover from stalls, errors and re-plugs) */
+            recoverStream = 1;
+            break;
+        case OPT_CPU:   /* --cpu <cpu> (pin the event thread to this CPU) */
+            eventCpu = myAtoi(optarg);
+            latencyReport = 1;
+            break;
+        case OPT_RT_PRIORITY:   /* --rt-priority <1-99> (run the event thread with SCHED_FIFO) */
+            eventPriority = myAtoi(optarg);
+            if(eventPriority < 1 || eventPriority > 99){
+                fprintf(stderr, "Real-time priority must be between 1 and 99.\n");
+                exit(1);
+            }
+            latencyReport = 1;
+            break;
+        case OPT_LOCK_MEMORY:   /* --lock-memory (lock all memory and prefault the stack) */
+            lockMemory = 1;
+            latencyReport = 1;
+            break;
+        case OPT_BUSY_POLL: /* --busy-poll (poll for completions without sleeping) */
+            busyPoll = 1;
+            latencyReport = 1;
+            break;
+        case OPT_LATENCY:   /* --latency (print the transfer latency distribution at the end) */
+            latencyReport = 1;
+            break;
+        case OPT_FRAMED:    /* --framed (output messages ended by short packets) */
+            framed = 1;
+            break;
+        case OPT_TIMESTAMPS:    /* --timestamps (write the completion time of each message) */
+            frameTimestamps = 1;
+            break;
         case 'c':   /* -c <configuration> (device configuration to choose) */
             usbConfiguration = myAtoi(optarg);
             break;
@@ -239,6 +597,12 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    if(vendorNamePattern == NULL)
+        vendorNamePattern = "*";
+    if(productNamePattern == NULL)
+        productNamePattern = "*";
+    if(serialPattern == NULL)
+        serialPattern = "*";
     argc -= optind;
     argv += optind;
     if(argc < 1){
@@ -258,7 +622,7 @@ int main(int argc, char **argv)
         action = ACTION_BULK;
     }else if(strcasecmp(argv[0], "info") == 0){
         action = ACTION_LIST;
-        verbose = 1;
+        verbose = infoFormat;
         argcnt = 1;
     }else{
         fprintf(stderr, "command %s not known\n", argv[0]);
@@ -273,6 +637,10 @@ int main(int argc, char **argv)
     if(argc > argcnt){
         fprintf(stderr, "Warning: only %d arguments expected, rest ignored.\n", argcnt);
     }
+    if(traceFile != NULL && traceOpen(traceFile, TRACE_DEFAULT_EVENTS) != 0){
+        fprintf(stderr, "error opening %s: %s\n", traceFile, strerror(errno));
+        exit(1);
+    }
     r = libusb_init(&usbCtx);
     if (r < 0) {
         fprintf(stderr, "Failed to initialize libusb %d", r);
@@ -317,10 +685,32 @@ int main(int argc, char **argv)
         exit (r);
     }
 
-    usbDirection = parseEnum(argv[1], "out", "in", NULL);
-    if(usbDirection){   /* IN transfer */
-        rxBuffer = malloc(usbCount);
+    usbDirection = parseEnum(argv[1], "out", "in", "download", NULL);
+    if(usbDirection == DIRECTION_DOWNLOAD && action != ACTION_CONTROL){
+        fprintf(stderr, "Download is only supported for control transfers.\n");
+        exit(1);
+    }
+    if(framed && (usbDirection != DIRECTION_IN || action == ACTION_CONTROL)){
+        fprintf(stderr, "Framing is only supported for interrupt and bulk IN.\n");
+        exit(1);
     }
+    if(usbDirection == DIRECTION_IN){
+        outFp = stdout;
+        if(outputFile != NULL){
+            int flags = O_WRONLY | O_CREAT | O_TRUNC, fd;
+#ifdef O_DIRECT
+            if(directOutput && outputFormatIsBinary && action != ACTION_CONTROL
+               && compressMethod == COMPRESS_NONE && !framed)
+                flags |= O_DIRECT;
+#endif
+            if((fd = open(outputFile, flags, 0666)) < 0
+               || (outFp = fdopen(fd, outputFormatIsBinary ? "wb" : "w")) == NULL){
+                fprintf(stderr, "Error writing \"%s\": %s\n", outputFile, strerror(errno));
+                exit(1);
+            }
+        }
+    }
+    traceThreadInit("usb events");
     if(action == ACTION_CONTROL){
         int requestType;
         usbType = parseEnum(argv[2], "standard", "class", "vendor", "reserved", NULL);
@@ -328,82 +718,181 @@ int main(int argc, char **argv)
         usbRequest = myAtoi(argv[4]);
         usbValue = myAtoi(argv[5]);
         usbIndex = myAtoi(argv[6]);
-        requestType = ((usbDirection & 1) << 7) | ((usbType & 3) << 5) | (usbRecipient & 0x1f);
-        if(usbDirection){   /* IN transfer */
+        requestType = ((usbDirection == DIRECTION_IN) << 7) | ((usbType & 3) << 5) | (usbRecipient & 0x1f);
+        if(usbDirection == DIRECTION_DOWNLOAD){
+            usbDownload download;
+
+            memset(&download, 0, sizeof(download));
+            download.handle = handle;
+            download.requestType = requestType;
+            download.request = usbRequest;
+            download.value = usbValue;
+            download.index = usbIndex;
+            download.addressing = downloadAddressing;
+            download.step = downloadStep;
+            download.data = sendBytes;
+            download.size = sendByteCount;
+            download.blockSize = downloadBlockSize;
+            download.depth = usbQueueDepth;
+            download.timeout = usbTimeout;
+            download.verify = downloadVerify;
+            download.verifyRequest = downloadVerifyRequest >= 0 ? downloadVerifyRequest : usbRequest;
+            download.progressFp = isatty(fileno(stderr)) ? stderr : NULL;
+            signal(SIGINT, onSignal);
+            signal(SIGTERM, onSignal);
+            if((statsInterval > 0 || statsFile != NULL)
+               && statsStart(&download.stats, statsInterval, statsFile, stderr) != 0){
+                fprintf(stderr, "Warning: could not start the statistics reporter\n");
+            }
+            len = usbDownloadRun(&download);
+            statsStop();
+            bytes = download.stats.bytes;
+        }else if(usbDirection == DIRECTION_IN){
+            traceEvent(TRACE_SUBMIT, 0);
+            rxBuffer = malloc(usbCount);
             len = libusb_control_transfer(handle, requestType & 0xff, usbRequest & 0xff,
                                           usbValue & 0xffff, usbIndex & 0xffff, rxBuffer, usbCount & 0xffff, usbTimeout);
+            traceEvent(TRACE_COMPLETE, 0);
+            traceEvent(TRACE_CALLBACK_RETURN, 0);
+            if(len > 0 && writeReceived(outFp, 0, rxBuffer, len) != 0){
+                fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+                outputError = 1;
+            }
+            bytes = len;
         }else{              /* OUT transfer */
+            if(sendByteCount > 0xffff){
+                fprintf(stderr, "%d bytes don't fit into one control request, use \"control download\".\n", sendByteCount);
+                exit(1);
+            }
+            traceEvent(TRACE_SUBMIT, 0);
             len = libusb_control_transfer(handle, requestType & 0xff, usbRequest & 0xff,
-                                          usbValue & 0xffff, usbIndex & 0xffff, sendBytes, sendByteCount & 0xffff, usbTimeout);
+                                          usbValue & 0xffff, usbIndex & 0xffff, sendBytes, sendByteCount, usbTimeout);
+            traceEvent(TRACE_COMPLETE, 0);
+            traceEvent(TRACE_CALLBACK_RETURN, 0);
+            bytes = len;
         }
     }else{  /* must be ACTION_INTERRUPT or ACTION_BULK */
-        int retries = 1;
-        if((r = libusb_set_configuration(handle, usbConfiguration)) && showWarnings){
-            fprintf(stderr, "Warning: could not set configuration: %s\n", libusb_error_name(r));
-        }
-        /* now try to claim the interface and detach the kernel HID driver on
-         * linux and other operating systems which support the call.
-         */
-        while((len = libusb_claim_interface(handle, usbInterface)) != 0 && retries-- > 0) {
-#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-            if ((r = libusb_detach_kernel_driver(handle, 0)) < 0 && showWarnings) {
-                fprintf(stderr, "Warning: could not detach kernel driver: %s\n", libusb_error_name(r));
+        usbStream stream;
+        long long startNs;
+
+        prepareInterface(handle);
+        memset(&stream, 0, sizeof(stream));
+        stream.handle = handle;
+        stream.recover = recoverStream;
+        stream.reopen = reopenDevice;
+        stream.type = action == ACTION_INTERRUPT ? LIBUSB_TRANSFER_TYPE_INTERRUPT : LIBUSB_TRANSFER_TYPE_BULK;
+        if(usbDirection == DIRECTION_IN){
+            stream.endpoint = 0x80 | (endpoint & 0xff);
+            if(framed){
+                /* a full transfer must end with a full packet */
+                int packetSize = libusb_get_max_packet_size(libusb_get_device(handle), stream.endpoint);
+
+                if(packetSize > 0 && usbCount % packetSize != 0){
+                    usbCount += packetSize - usbCount % packetSize;
+                    if(showWarnings)
+                        fprintf(stderr, "Warning: rounded the transfer size up to %d bytes, a multiple of the packet size\n", usbCount);
+                }
             }
-#endif
-        }
-        if(len != 0 && showWarnings)
-            fprintf(stderr, "Warning: could not claim interface: %s\n", libusb_error_name(len));
-        if(action == ACTION_INTERRUPT){
-            if(usbDirection){   /* IN transfer */
-                r = libusb_interrupt_transfer(handle, 0x80 | (endpoint & 0xff), rxBuffer, usbCount, &len, usbTimeout);
-            }else{
-                r = libusb_interrupt_transfer(handle, (endpoint & 0x7f), sendBytes, sendByteCount, &len, usbTimeout);
+            stream.bufferSize = usbCount;
+            stream.sink = 1;
+            fflush(outFp);
+            if(compressMethod != COMPRESS_NONE){
+                if(!outputFormatIsBinary){
+                    fprintf(stderr, "Compression needs binary output (-b).\n");
+                    exit(1);
+                }
+                if(compressStart(fileno(outFp), compressMethod, compressLevel,
+                                 compressThreads, &stream.stats) != 0){
+                    fprintf(stderr, "Error starting compression: %s\n", strerror(errno));
+                    exit(1);
+                }
+            }
+            if(framed && frameStart(compressMethod != COMPRESS_NONE ? compressWrite : writeOutput, outFp, usbCount,
+                                    outputFormatIsBinary ? FRAME_RECORDS : FRAME_HEX, frameTimestamps, &stream.stats) != 0){
+                fprintf(stderr, "Error starting framing: %s\n", strerror(errno));
+                exit(1);
+            }
+            if(sinkStart(fileno(outFp),
+                         framed ? frameWrite : compressMethod != COMPRESS_NONE ? compressWrite
+                         : outputFormatIsBinary ? NULL : writeReceived,
+                         outFp, usbCount, sinkBuffers > 0 ? sinkBuffers : 2 * usbQueueDepth + 32, usbQueueDepth) != 0){
+                fprintf(stderr, "Error starting output: %s\n", strerror(errno));
+                exit(1);
             }
-            if (r < 0)
-                len = r;
         }else{
-            if(usbDirection){   /* IN transfer */
-                r = libusb_bulk_transfer(handle, 0x80 | (endpoint & 0xff), rxBuffer, usbCount, &len, usbTimeout);
-            }else{
-                r = libusb_bulk_transfer(handle, (endpoint & 0x7f), sendBytes, sendByteCount, &len, usbTimeout);
+            stream.endpoint = endpoint & 0x7f;
+            stream.sendBytes = sendBytes;
+            stream.sendByteCount = sendByteCount;
+        }
+        stream.depth = usbQueueDepth;
+        stream.count = usbTransferCount;
+        stream.timeout = usbTimeout;
+        stream.busyPoll = busyPoll;
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        if((statsInterval > 0 || statsFile != NULL)
+           && statsStart(&stream.stats, statsInterval, statsFile, stderr) != 0){
+            fprintf(stderr, "Warning: could not start the statistics reporter\n");
+        }
+        /* last, so that the threads started above don't inherit the settings */
+        /* reported even with -w: the latency measured depends on them */
+        if(eventCpu >= 0 || eventPriority > 0 || lockMemory)
+            realtimeMissing = realtimeEnter(eventCpu, eventPriority, lockMemory, stderr);
+        startNs = statsClockNs();
+        len = usbStreamRun(&stream);
+        handle = stream.handle;     /* may have been reopened */
+        if(stream.sink && sinkStop() != 0){
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            outputError = 1;
+        }
+        if(framed && frameStop() != 0){
+            fprintf(stderr, "Error writing messages: %s\n", strerror(errno));
+            outputError = 1;
+        }
+        if(compressMethod != COMPRESS_NONE){
+            if(compressStop() != 0){
+                fprintf(stderr, "Error writing compressed output: %s\n", strerror(errno));
+                outputError = 1;
+            }else if(stream.stats.compressOut > 0){
+                fprintf(stderr, "Compressed %llu bytes to %llu (ratio %.2f), waited for the compressor %.1f%% of the time.\n",
+                        stream.stats.compressIn, stream.stats.compressOut,
+                        (double)stream.stats.compressIn / stream.stats.compressOut,
+                        stream.stats.compressWaitNs * 100.0 / (statsClockNs() - startNs));
             }
-            if (r < 0)
-                len = r;
         }
+        statsStop();
+        if(latencyReport){
+            statsPrintLatency(&stream.stats, stderr);
+            if(realtimeMissing & REALTIME_CPU)
+                fprintf(stderr, "Note: measured without the requested CPU pinning, it could not be applied.\n");
+            if(realtimeMissing & REALTIME_PRIORITY)
+                fprintf(stderr, "Note: measured without the requested SCHED_FIFO priority, it could not be applied.\n");
+            if(realtimeMissing & REALTIME_LOCK)
+                fprintf(stderr, "Note: measured without the requested memory locking, it could not be applied.\n");
+        }
+        if(framed)
+            statsPrintMessages(&stream.stats, stderr);
+        if(recoverStream)
+            fprintf(stderr, "%llu recoveries (%llu reconnects) took %.1f ms, %llu transfers lost, %llu dropped for lack of buffers.\n",
+                    stream.stats.recoveries, stream.stats.reconnects, stream.stats.recoveryNs / 1e6,
+                    stream.stats.lost, stream.stats.overruns);
+        bytes = stream.stats.bytes;
     }
+    if(traceClose() != 0)
+        fprintf(stderr, "Error writing \"%s\": %s\n", traceFile, strerror(errno));
     if(len < 0){
         fprintf(stderr, "USB error: %s\n", libusb_error_name(len));
         exit(1);
     }
-    if(usbDirection == 0)   /* OUT */
-        printf("%d bytes sent.\n", len);
-    if(rxBuffer != NULL){
-        FILE *fp = stdout;
-        if(outputFile != NULL){
-            fp = fopen(outputFile, outputFormatIsBinary ? "wb" : "w");
-            if(fp == NULL){
-                fprintf(stderr, "Error writing \"%s\": %s\n", outputFile, strerror(errno));
-                exit(1);
-            }
-        }
-        if(outputFormatIsBinary){
-            fwrite(rxBuffer, 1, len, fp);
-        }else{
-            int i;
-            for(i = 0; i < len; i++){
-                if(i != 0){
-                    if(i % 16 == 0){
-                        fprintf(fp, "\n");
-                    }else{
-                        fprintf(fp, " ");
-                    }
-                }
-                fprintf(fp, "0x%02x", rxBuffer[i] & 0xff);
-            }
-            if(i != 0)
-                fprintf(fp, "\n");
-        }
+    /* stdio reports some errors only when the buffered output is written out */
+    if(outFp != NULL && !outputError && (outFp != stdout ? fclose(outFp) : fflush(outFp)) != 0){
+        fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+        outputError = 1;
     }
+    if(outputError)
+        exit(1);
+    if(usbDirection != DIRECTION_IN)
+        printf("%lld bytes sent.\n", bytes);
     libusb_close(handle);
     if(rxBuffer != NULL)
         free(rxBuffer);